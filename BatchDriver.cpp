@@ -0,0 +1,176 @@
+/*
+BatchDriver.cpp
+
+Runs keypoint detection and descriptor extraction over a set of images, several images at a time.
+*/
+
+#include "BatchDriver.h"
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+using namespace std;
+
+BatchDriver::BatchDriver(const DescriptorUtil &util, int numWorkers, int maxInFlight)
+    : util(util), numWorkers(std::max(numWorkers, 1)), maxInFlight(std::max(maxInFlight, 1)), inFlight(0)
+{
+}
+
+// Processes the images relativePath + imageNames[0 .. numImgs - 1], computing numTypes descriptor types for each
+void BatchDriver::run(const string &relativePath, const string *imageNames, int numImgs,
+                      const DescriptorType *types, int numTypes, ResultHandler onResult)
+{
+    // No more than maxInFlight images exist at once, so pushes never wait on a full queue for long
+    ImageQueue decoded(maxInFlight), detected(maxInFlight);
+    error = exception_ptr();
+    inFlight = 0;
+
+    vector<thread> detectors, describers;
+    for (int i = 0; i < numWorkers; ++i) {
+        detectors.push_back(thread(&BatchDriver::detectStage, this, imageNames, types, numTypes, ref(decoded), ref(detected)));
+        describers.push_back(thread(&BatchDriver::describeStage, this, imageNames, types, numTypes, ref(detected), onResult));
+    }
+
+    // The calling thread decodes
+    decodeStage(relativePath, imageNames, numImgs, decoded);
+    decoded.close();
+    for (size_t i = 0; i < detectors.size(); ++i) {
+        detectors[i].join();
+    }
+    detected.close();
+    for (size_t i = 0; i < describers.size(); ++i) {
+        describers[i].join();
+    }
+
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+// Reads the images in order, each one only once an in-flight slot is free
+void BatchDriver::decodeStage(const string &relativePath, const string *imageNames, int numImgs, ImageQueue &out)
+{
+    for (int j = 0; j < numImgs && !failed(); ++j) {
+        acquireSlot();
+        Ptr<BatchImage> job = makePtr<BatchImage>();
+        job->index = j;
+        try {
+            job->image = imread((relativePath + imageNames[j]).c_str());
+            if (job->image.empty()) {
+                CV_Error(CV_StsError, "Unable to read image " + relativePath + imageNames[j]);
+            }
+        }
+        catch (...) {
+            fail(current_exception());
+            releaseSlot();
+            break;
+        }
+        out.push(job);
+    }
+}
+
+// Detects the keypoints of each image. This builds the image's scale space, including the pyramids of the descriptor types, which the
+// describe stage reuses
+void BatchDriver::detectStage(const string *imageNames, const DescriptorType *types, int numTypes, ImageQueue &in, ImageQueue &out)
+{
+    Ptr<BatchImage> job;
+    while (in.pop(job)) {
+        if (!failed()) {
+            try {
+                log(">> Computing keypoints for " + imageNames[job->index] + "...");
+                job->lease = makePtr<DescriptorUtil::ScaleSpaceLease>(util, job->image);
+                util.detectFeatures(job->image, job->kpts, types, numTypes);
+            }
+            catch (...) {
+                fail(current_exception());
+            }
+        }
+        // Even a failed image goes on, so that the describe stage frees its scale space and slot
+        out.push(job);
+        job.release();
+    }
+}
+
+// Computes every descriptor type of each image, hands the image on and frees its slot
+void BatchDriver::describeStage(const string *imageNames, const DescriptorType *types, int numTypes, ImageQueue &in, ResultHandler onResult)
+{
+    Ptr<BatchImage> job;
+    while (in.pop(job)) {
+        bool ok = !failed();
+        if (ok) {
+            try {
+                log(">> Computing descriptors for " + imageNames[job->index] + "...");
+                job->descriptors.resize(numTypes);
+                for (int i = 0; i < numTypes; ++i) {
+                    if (types[i].doubleDescriptor) {
+                        Mat descriptors1 = util.computeDescriptors(job->image, job->kpts, types[i].first);
+                        Mat descriptors2 = util.computeDescriptors(job->image, job->kpts, types[i].second);
+
+                        // Merge descriptors
+                        job->descriptors[i] = util.mergeDescriptors(descriptors1, descriptors2);
+                    }
+                    else {
+                        job->descriptors[i] = util.computeDescriptors(job->image, job->kpts, types[i].first);
+                    }
+                }
+
+                // What the image's pyramids hold once all of its descriptors are done, for comparing float with fixed-point runs
+                stringstream line;
+                line << ">> Scale space of " << imageNames[job->index] << ": " << fixed << setprecision(1)
+                     << util.getScaleSpace(job->image)->memoryBytes() / (1024. * 1024.) << " MB";
+                log(line.str());
+            }
+            catch (...) {
+                fail(current_exception());
+                ok = false;
+            }
+        }
+        // The pyramids are by far the largest part of an image's memory; drop them before handing it on
+        job->lease.release();
+
+        if (ok) {
+            try {
+                onResult(*job);
+            }
+            catch (...) {
+                fail(current_exception());
+            }
+        }
+        job.release();
+        releaseSlot();
+    }
+}
+
+void BatchDriver::acquireSlot()
+{
+    unique_lock<mutex> lock(slotLock);
+    slotFree.wait(lock, [this] { return inFlight < maxInFlight; });
+    ++inFlight;
+}
+
+void BatchDriver::releaseSlot()
+{
+    lock_guard<mutex> lock(slotLock);
+    --inFlight;
+    slotFree.notify_one();
+}
+
+void BatchDriver::fail(exception_ptr e)
+{
+    lock_guard<mutex> lock(errorLock);
+    if (!error) {
+        error = e;
+    }
+}
+
+bool BatchDriver::failed()
+{
+    lock_guard<mutex> lock(errorLock);
+    return (bool)error;
+}
+
+void BatchDriver::log(const string &line)
+{
+    lock_guard<mutex> lock(logLock);
+    cout << line << endl;
+}
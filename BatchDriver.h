@@ -0,0 +1,130 @@
+/*
+BatchDriver.h
+
+Runs keypoint detection and descriptor extraction over a set of images, several images at a
+time. A decode stage reads the images, a pool of detect workers finds their keypoints and a
+pool of describe workers computes every descriptor type. The stages are connected by bounded
+queues, and at most maxInFlight images (with their scale spaces) are held by the pipeline at
+once, however many images the set has.
+*/
+
+#ifndef BATCH_DRIVER_H
+#define BATCH_DRIVER_H
+
+#include "DescriptorUtil.h"
+#include "DescriptorType.h"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+// A FIFO queue holding at most capacity items. push waits while it is full, pop while it is empty
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : cap(capacity), closed(false) { }
+
+    // Appends an item, waiting for room
+    void push(const T &item)
+    {
+        unique_lock<mutex> lock(m);
+        notFull.wait(lock, [this] { return items.size() < cap; });
+        items.push_back(item);
+        notEmpty.notify_one();
+    }
+
+    // Removes the oldest item, waiting for one. Returns false once the queue is closed and drained
+    bool pop(T &item)
+    {
+        unique_lock<mutex> lock(m);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // Marks the end of the input; consumers drain what is left and then stop
+    void close()
+    {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t cap;
+    bool closed;
+    deque<T> items;
+    mutex m;
+    condition_variable notFull, notEmpty;
+};
+
+// One image travelling through the pipeline
+struct BatchImage {
+    int index;
+    Mat image;
+    vector<KeyPoint> kpts;
+    // Keeps the image's scale space cached from detection until its descriptors are computed
+    Ptr<DescriptorUtil::ScaleSpaceLease> lease;
+    // One descriptor matrix per descriptor type, in the order the types were given
+    vector<Mat> descriptors;
+};
+
+class BatchDriver
+{
+public:
+    // Receives each image once all of its descriptors are computed. It is called from the
+    // describe workers, possibly concurrently and in completion order rather than image order
+    typedef function<void(BatchImage &)> ResultHandler;
+
+    // numWorkers is the size of each of the detect and describe pools. maxInFlight caps the
+    // images read but not yet handed to the result handler. The workers share util through its
+    // const members, which are safe to call concurrently; util must not be reconfigured during run
+    BatchDriver(const DescriptorUtil &util, int numWorkers, int maxInFlight);
+
+    // Processes the images relativePath + imageNames[0 .. numImgs - 1], computing numTypes descriptor types for each.
+    // Returns once every image has been handed to onResult; if any stage failed, the first error is rethrown instead
+    void run(const string &relativePath, const string *imageNames, int numImgs,
+             const DescriptorType *types, int numTypes, ResultHandler onResult);
+
+private:
+    typedef BoundedQueue<Ptr<BatchImage> > ImageQueue;
+
+    // Pipeline stages
+    void decodeStage(const string &relativePath, const string *imageNames, int numImgs, ImageQueue &out);
+    void detectStage(const string *imageNames, const DescriptorType *types, int numTypes, ImageQueue &in, ImageQueue &out);
+    void describeStage(const string *imageNames, const DescriptorType *types, int numTypes, ImageQueue &in, ResultHandler onResult);
+
+    // In-flight image slots
+    void acquireSlot();
+    void releaseSlot();
+
+    // Records the first error; the stages skip the work of every image after it
+    void fail(exception_ptr e);
+    bool failed();
+
+    // Writes a progress line without interleaving it with other workers' output
+    void log(const string &line);
+
+    const DescriptorUtil &util;
+    int numWorkers;
+    int maxInFlight;
+
+    int inFlight;
+    mutex slotLock;
+    condition_variable slotFree;
+
+    exception_ptr error;
+    mutex errorLock;
+    mutex logLock;
+};
+
+#endif
@@ -0,0 +1,151 @@
+/*
+Benchmark.cpp
+
+Timing runs behind the benchmark options of main.
+*/
+
+#include "Benchmark.h"
+#include "NewDescriptorExtractor.h"
+#include "ScaleSpace.h"
+#include <cfloat>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+namespace
+{
+    // Fraction of the query rows whose nearest neighbour is the same in both match lists
+    double agreement(const vector<DMatch> &a, const vector<DMatch> &b)
+    {
+        if (a.empty()) {
+            return 1;
+        }
+        int same = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (a[i].trainIdx == b[i].trainIdx) {
+                ++same;
+            }
+        }
+        return (double)same / a.size();
+    }
+
+    // Indexes train and matches query against it runs times. Returns the fastest run in milliseconds and the matches of
+    // every run, and sets stable to the lowest agreement of any run with the first
+    double timeMatcher(const Mat &query, const Mat &train, MATCHER_TYPES type, int runs,
+                       vector<vector<DMatch> > &matches, double &stable)
+    {
+        double best = DBL_MAX;
+        matches.resize(runs);
+        stable = 1;
+        for (int r = 0; r < runs; ++r) {
+            int64 t = getTickCount();
+            MatcherIndex index(train, type);
+            index.match(query, matches[r]);
+            best = std::min(best, (getTickCount() - t) * 1000. / getTickFrequency());
+            stable = std::min(stable, agreement(matches[r], matches[0]));
+        }
+        return best;
+    }
+}
+
+// Times FLANN against the brute-force matcher on every pair that the evaluation matches
+void benchmarkMatchers(Mat *const *descriptors, int numTypes, int numImgs, int runs)
+{
+    CV_Assert(runs > 0);
+    cout << ">> Matcher benchmark: best of " << runs << " runs, index and match, image 0 against image i" << endl;
+    cout << "type\timage\tqueries\ttrain\tflann ms\texact ms\tflann = exact\tflann stable\texact stable" << endl;
+    for (int j = 0; j < numTypes; ++j) {
+        const Mat &query = descriptors[j][0];
+        for (int i = 1; i < numImgs; ++i) {
+            const Mat &train = descriptors[j][i];
+            vector<vector<DMatch> > flann, exact;
+            double flannStable, exactStable;
+            double flannTime = timeMatcher(query, train, FLANN_MATCHER, runs, flann, flannStable);
+            double exactTime = timeMatcher(query, train, BRUTE_FORCE_MATCHER, runs, exact, exactStable);
+
+            // How close FLANN comes to the exact neighbours, averaged over its runs
+            double correct = 0;
+            for (int r = 0; r < runs; ++r) {
+                correct += agreement(flann[r], exact[0]);
+            }
+            correct /= runs;
+
+            printf("%d\t%d\t%d\t%d\t%.2f\t%.2f\t%.2f%%\t%.2f%%\t%.2f%%\n", j, i, query.rows, train.rows,
+                   flannTime, exactTime, 100 * correct, 100 * flannStable, 100 * exactStable);
+        }
+    }
+}
+
+// Times NEWSIFT's descriptors on 1x, 2x and 4x keypoint subsets of one image
+void benchmarkNewSift(const Mat &image, int runs)
+{
+    CV_Assert(runs > 0 && !image.empty());
+    Ptr<NEWSIFT> newSift = NEWSIFT::create();
+    newSift->setNumThreads(1);
+
+    // The levels stay built across the runs, so only the descriptors are timed. The first run over all keypoints also
+    // grows the scratch buffers to their largest size
+    ScaleSpace scaleSpace(image);
+    vector<KeyPoint> all;
+    Mat descriptors;
+    (*newSift)(scaleSpace, noArray(), all, noArray());
+    (*newSift)(scaleSpace, noArray(), all, descriptors, true);
+
+    cout << ">> NEWSIFT benchmark: best of " << runs << " runs, one thread, " << image.cols << "x" << image.rows << endl;
+    cout << "subset	keypoints	ms	us per keypoint" << endl;
+    for (int stride = 4; stride >= 1; stride /= 2) {
+        vector<KeyPoint> subset;
+        for (size_t k = 0; k < all.size(); k += stride) {
+            subset.push_back(all[k]);
+        }
+        double best = DBL_MAX;
+        for (int r = 0; r < runs; ++r) {
+            vector<KeyPoint> kpts = subset;
+            int64 t = getTickCount();
+            (*newSift)(scaleSpace, noArray(), kpts, descriptors, true);
+            best = std::min(best, (getTickCount() - t) * 1000. / getTickFrequency());
+        }
+        printf("%dx\t%d\t%.2f\t%.2f\n", 4 / stride, (int)subset.size(), best,
+               subset.empty() ? 0. : 1000 * best / subset.size());
+    }
+}
+
+// Times the pyramid task graph of a 2 MP image on 1, 2 and 4 threads
+void benchmarkPyramids(const Mat &image, int depth, double megapixels, int runs)
+{
+    CV_Assert(runs > 0 && !image.empty());
+    Mat scaled;
+    double f = std::sqrt(megapixels * 1e6 / image.total());
+    resize(image, scaled, Size(), f, f, f > 1 ? INTER_CUBIC : INTER_AREA);
+
+    vector<ScaleSpace::Pyramid> pyramids;
+    pyramids.push_back(ScaleSpace::BGR);
+    pyramids.push_back(ScaleSpace::HSV);
+    pyramids.push_back(ScaleSpace::OPPONENT);
+
+    cout << ">> Pyramid benchmark: best of " << runs << " runs, " << scaled.cols << "x" << scaled.rows
+         << (depth == CV_16S ? ", fixed point" : ", float") << endl;
+    cout << "threads	ms	speedup	MB" << endl;
+    // build() runs its workers on OpenCV's pool, which needs at least as many threads
+    int poolThreads = getNumThreads();
+    double serial = 0;
+    for (int nThreads = 1; nThreads <= 4; nThreads *= 2) {
+        setNumThreads(std::max(poolThreads, nThreads));
+        double best = DBL_MAX;
+        size_t bytes = 0;
+        for (int r = 0; r < runs; ++r) {
+            // Every level is built once per scale space, so each run starts from a new one
+            ScaleSpace scaleSpace(scaled, -1, 3, 1.6, depth);
+            int64 t = getTickCount();
+            scaleSpace.build(pyramids, true, nThreads);
+            best = std::min(best, (getTickCount() - t) * 1000. / getTickFrequency());
+            bytes = scaleSpace.memoryBytes();
+        }
+        if (nThreads == 1) {
+            serial = best;
+        }
+        printf("%d\t%.2f\t%.2f\t%.1f\n", nThreads, best, serial / best, bytes / (1024. * 1024.));
+    }
+    setNumThreads(poolThreads);
+}
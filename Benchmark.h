@@ -0,0 +1,31 @@
+/*
+Benchmark.h
+
+Timing runs behind the benchmark options of main. Each one works on what the normal run
+computes, or on the first image of the script, and writes its figures to the console.
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "MatcherIndex.h"
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Matches image 0's descriptors of every type against each other image's, as DescriptorUtil::match() pairs them, with
+// FLANN_MATCHER and then BRUTE_FORCE_MATCHER, runs times each. Reports the time to index and match a pair, how many of
+// FLANN's nearest neighbours are the exact ones, and how many nearest neighbours every run shares with the first run.
+// Every FLANN run builds its forest from a different random state, so that last figure is FLANN's run-to-run noise
+void benchmarkMatchers(Mat *const *descriptors, int numTypes, int numImgs, int runs = 5);
+
+// Detects the keypoints of a BGR image and times NEWSIFT's descriptors for a quarter, half and all of them, on one thread
+// and with the pyramids already built. The subsets take every fourth and every second keypoint, so they cover the same
+// octaves as the full set; the time per keypoint should stay flat as the count grows
+void benchmarkNewSift(const Mat &image, int runs = 5);
+
+// Scales a BGR image to about megapixels million pixels and times ScaleSpace::build() of the grey, DoG, BGR, HSV and
+// opponent pyramids on 1, 2 and 4 threads, as detection builds them (doubled first octave). Reports the time, the speedup
+// over one thread and the memory the pyramids hold. depth is the element depth of the pyramids, CV_32F or CV_16S
+void benchmarkPyramids(const Mat &image, int depth = CV_32F, double megapixels = 2, int runs = 5);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+BruteForceMatcher.cpp
+
+Exact nearest-neighbour matching of descriptors under the L2 distance.
+*/
+
+#include "BruteForceMatcher.h"
+#include <cfloat>
+#include <limits>
+#include <mutex>
+
+namespace
+{
+    // Query rows that share one pass over a train tile
+    const int QUERY_BLOCK = 16;
+    // Train rows per tile: 512 rows of 384 floats still fit in a 1 MB L2 cache
+    const int TRAIN_BLOCK = 512;
+
+    // Type the squared distance of two descriptors is accumulated in. 8-bit descriptors sum exactly in integers
+    template <typename T> struct DistanceType { typedef float type; };
+    template <> struct DistanceType<uchar> { typedef int type; };
+
+    // Squared L2 distance of two descriptors. D is the descriptor size fixed at compile time, or 0 to use dims
+    template <int D>
+    inline float distanceSqr(const float *a, const float *b, int dims)
+    {
+        const int n = D > 0 ? D : dims;
+        int k = 0;
+        float d = 0;
+#if CV_AVX
+        __m256 s = _mm256_setzero_ps();
+        for (; k <= n - 8; k += 8) {
+            __m256 t = _mm256_sub_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k));
+            s = _mm256_add_ps(s, _mm256_mul_ps(t, t));
+        }
+        float buf[8];
+        _mm256_storeu_ps(buf, s);
+        d = ((buf[0] + buf[1]) + (buf[2] + buf[3])) + ((buf[4] + buf[5]) + (buf[6] + buf[7]));
+#elif CV_SSE2
+        __m128 s = _mm_setzero_ps();
+        for (; k <= n - 4; k += 4) {
+            __m128 t = _mm_sub_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k));
+            s = _mm_add_ps(s, _mm_mul_ps(t, t));
+        }
+        float buf[4];
+        _mm_storeu_ps(buf, s);
+        d = (buf[0] + buf[1]) + (buf[2] + buf[3]);
+#endif
+        for (; k < n; ++k) {
+            float t = a[k] - b[k];
+            d += t * t;
+        }
+        return d;
+    }
+
+    template <int D>
+    inline int distanceSqr(const uchar *a, const uchar *b, int dims)
+    {
+        const int n = D > 0 ? D : dims;
+        int k = 0;
+        int d = 0;
+#if CV_AVX2
+        __m256i s = _mm256_setzero_si256();
+        for (; k <= n - 16; k += 16) {
+            __m256i t = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + k))),
+                                         _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + k))));
+            s = _mm256_add_epi32(s, _mm256_madd_epi16(t, t));
+        }
+        int buf[8];
+        _mm256_storeu_si256((__m256i *)buf, s);
+        d = buf[0] + buf[1] + buf[2] + buf[3] + buf[4] + buf[5] + buf[6] + buf[7];
+#elif CV_SSE2
+        __m128i s = _mm_setzero_si128(), z = _mm_setzero_si128();
+        for (; k <= n - 16; k += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + k));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + k));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, z), _mm_unpacklo_epi8(vb, z));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, z), _mm_unpackhi_epi8(vb, z));
+            s = _mm_add_epi32(s, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        int buf[4];
+        _mm_storeu_si128((__m128i *)buf, s);
+        d = buf[0] + buf[1] + buf[2] + buf[3];
+#endif
+        for (; k < n; ++k) {
+            int t = (int)a[k] - (int)b[k];
+            d += t * t;
+        }
+        return d;
+    }
+
+    // Matches the query rows of a range of query blocks, keeping the nearest and second nearest train row of each.
+    // Every block writes only its own matches, so blocks can run concurrently. With a reverse array, the nearest query
+    // row of every train row is found in the same pass: each range tracks its own and merges it in at the end, so the
+    // caller keeps the ranges few
+    template <typename T, int D>
+    class MatchComputer : public ParallelLoopBody
+    {
+    public:
+        typedef typename DistanceType<T>::type DistT;
+
+        MatchComputer(const Mat &_query, const Mat &_train, DMatch *_nearest, DMatch *_second,
+                      DistT *_reverseDist, int *_reverseIdx, mutex *_reverseLock)
+            : query(_query), train(_train), nearest(_nearest), second(_second),
+              reverseDist(_reverseDist), reverseIdx(_reverseIdx), reverseLock(_reverseLock)
+        {
+        }
+
+        void operator()(const Range &range) const
+        {
+            const DistT maxDist = std::numeric_limits<DistT>::max();
+            int dims = query.cols;
+            DistT best[QUERY_BLOCK], next[QUERY_BLOCK];
+            int bestIdx[QUERY_BLOCK], nextIdx[QUERY_BLOCK];
+
+            // Nearest query row of every train row, over this range only
+            vector<DistT> revDist;
+            vector<int> revIdx;
+            if (reverseDist) {
+                revDist.assign(train.rows, maxDist);
+                revIdx.assign(train.rows, -1);
+            }
+
+            for (int qb = range.start; qb < range.end; ++qb) {
+                int q0 = qb * QUERY_BLOCK, q1 = std::min(q0 + QUERY_BLOCK, query.rows);
+                for (int i = q0; i < q1; ++i) {
+                    best[i - q0] = next[i - q0] = maxDist;
+                    bestIdx[i - q0] = nextIdx[i - q0] = -1;
+                }
+
+                // The query block stays in L1 while one train tile after another streams past it
+                for (int t0 = 0; t0 < train.rows; t0 += TRAIN_BLOCK) {
+                    int t1 = std::min(t0 + TRAIN_BLOCK, train.rows);
+                    for (int i = q0; i < q1; ++i) {
+                        const T *q = query.ptr<T>(i);
+                        DistT b = best[i - q0], n = next[i - q0];
+                        int bi = bestIdx[i - q0], ni = nextIdx[i - q0];
+                        for (int j = t0; j < t1; ++j) {
+                            DistT d = distanceSqr<D>(q, train.ptr<T>(j), dims);
+                            if (d < n) {
+                                if (d < b) {
+                                    n = b;
+                                    ni = bi;
+                                    b = d;
+                                    bi = j;
+                                }
+                                else {
+                                    n = d;
+                                    ni = j;
+                                }
+                            }
+                            // Query rows arrive in increasing order, so ties keep the lower one
+                            if (reverseDist && d < revDist[j]) {
+                                revDist[j] = d;
+                                revIdx[j] = i;
+                            }
+                        }
+                        best[i - q0] = b;
+                        next[i - q0] = n;
+                        bestIdx[i - q0] = bi;
+                        nextIdx[i - q0] = ni;
+                    }
+                }
+
+                for (int i = q0; i < q1; ++i) {
+                    nearest[i] = DMatch(i, bestIdx[i - q0], 0, std::sqrt((float)best[i - q0]));
+                    if (second) {
+                        second[i] = DMatch(i, nextIdx[i - q0], 0,
+                                           nextIdx[i - q0] < 0 ? FLT_MAX : std::sqrt((float)next[i - q0]));
+                    }
+                }
+            }
+
+            if (reverseDist) {
+                lock_guard<mutex> lock(*reverseLock);
+                for (int j = 0; j < train.rows; ++j) {
+                    if (revIdx[j] >= 0 && (revDist[j] < reverseDist[j] ||
+                                           (revDist[j] == reverseDist[j] && revIdx[j] < reverseIdx[j]))) {
+                        reverseDist[j] = revDist[j];
+                        reverseIdx[j] = revIdx[j];
+                    }
+                }
+            }
+        }
+
+    private:
+        const Mat &query;
+        const Mat &train;
+        DMatch *nearest;
+        DMatch *second;
+        DistT *reverseDist;
+        int *reverseIdx;
+        mutex *reverseLock;
+    };
+
+    // Runs the matcher specialized for the descriptor size, if there is one. second and reverse may be null
+    template <typename T>
+    void matchBlocks(const Mat &query, const Mat &train, DMatch *nearest, DMatch *second, int *reverse)
+    {
+        typedef typename DistanceType<T>::type DistT;
+        vector<DistT> reverseDist;
+        mutex reverseLock;
+        if (reverse) {
+            reverseDist.assign(train.rows, std::numeric_limits<DistT>::max());
+            std::fill(reverse, reverse + train.rows, -1);
+        }
+        DistT *revDist = reverse ? &reverseDist[0] : 0;
+
+        Range blocks(0, (query.rows + QUERY_BLOCK - 1) / QUERY_BLOCK);
+        // Every range allocates and merges a reverse array as long as the train set, so with one the blocks are
+        // split into one range per thread rather than into the default, much finer stripes
+        double nstripes = reverse ? std::max(getNumThreads(), 1) : -1.;
+        switch (query.cols) {
+        case 128:
+            parallel_for_(blocks, MatchComputer<T, 128>(query, train, nearest, second, revDist, reverse, &reverseLock), nstripes);
+            break;
+        case 256:
+            parallel_for_(blocks, MatchComputer<T, 256>(query, train, nearest, second, revDist, reverse, &reverseLock), nstripes);
+            break;
+        case 384:
+            parallel_for_(blocks, MatchComputer<T, 384>(query, train, nearest, second, revDist, reverse, &reverseLock), nstripes);
+            break;
+        default:
+            parallel_for_(blocks, MatchComputer<T, 0>(query, train, nearest, second, revDist, reverse, &reverseLock), nstripes);
+            break;
+        }
+    }
+}
+
+BruteForceMatcher::BruteForceMatcher()
+{
+}
+
+// Sets the train descriptors
+void BruteForceMatcher::train(const Mat &descriptors)
+{
+    CV_Assert(descriptors.empty() || descriptors.type() == CV_32F || descriptors.type() == CV_8U);
+    trainDescr = descriptors;
+}
+
+// Finds the nearest train descriptor of every query row
+void BruteForceMatcher::match(const Mat &query, vector<DMatch> &matches) const
+{
+    matchNearest(query, matches, 0, 0);
+}
+
+// Finds the two nearest train descriptors of every query row, and optionally the nearest query row of every train row
+void BruteForceMatcher::knnMatch(const Mat &query, vector<DMatch> &nearest, vector<DMatch> &second, vector<int> *reverse) const
+{
+    matchNearest(query, nearest, &second, reverse);
+}
+
+void BruteForceMatcher::matchNearest(const Mat &query, vector<DMatch> &nearest, vector<DMatch> *second, vector<int> *reverse) const
+{
+    nearest.clear();
+    if (second) {
+        second->clear();
+    }
+    if (reverse) {
+        reverse->assign(trainDescr.rows, -1);
+    }
+    if (query.empty() || trainDescr.empty()) {
+        return;
+    }
+    CV_Assert(query.cols == trainDescr.cols && (query.type() == CV_32F || query.type() == CV_8U));
+
+    // Mixed inputs are compared as floats
+    Mat q = query, t = trainDescr;
+    if (q.type() != t.type()) {
+        q.convertTo(q, CV_32F);
+        t.convertTo(t, CV_32F);
+    }
+
+    nearest.resize(q.rows);
+    DMatch *secondPtr = 0;
+    if (second) {
+        second->resize(q.rows);
+        secondPtr = &(*second)[0];
+    }
+    int *reversePtr = reverse ? &(*reverse)[0] : 0;
+    if (q.type() == CV_8U) {
+        matchBlocks<uchar>(q, t, &nearest[0], secondPtr, reversePtr);
+    }
+    else {
+        matchBlocks<float>(q, t, &nearest[0], secondPtr, reversePtr);
+    }
+}
@@ -0,0 +1,42 @@
+/*
+BruteForceMatcher.h
+
+Exact nearest-neighbour matching of descriptors under the L2 distance. Unlike the FLANN
+KD-tree forest it replaces, the result does not depend on a randomized index, so precision
+and recall come out the same on every run. Query and train descriptors are compared in
+cache-sized tiles, with SIMD distance kernels for float and 8-bit descriptors that are
+specialized at compile time for 128, 256 and 384 dimensions (any other size still works).
+*/
+
+#ifndef BRUTE_FORCE_MATCHER_H
+#define BRUTE_FORCE_MATCHER_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+using namespace std;
+using namespace cv;
+
+class BruteForceMatcher
+{
+public:
+    BruteForceMatcher();
+
+    // Sets the train descriptors, one per row, CV_32F or CV_8U. The matrix is referenced, not copied
+    void train(const Mat &descriptors);
+
+    // Finds the nearest train descriptor of every query row. matches[i] belongs to query row i and its distance is the
+    // Euclidean distance. Ties go to the lower train index
+    void match(const Mat &query, vector<DMatch> &matches) const;
+
+    // Finds the two nearest train descriptors of every query row in one pass, for the ratio test. second[i] has trainIdx -1
+    // and distance FLT_MAX when there is only one train descriptor. If reverse is given, it also receives the nearest query
+    // row of every train descriptor (-1 if there are no queries), found in the same pass, for a mutual-consistency check
+    void knnMatch(const Mat &query, vector<DMatch> &nearest, vector<DMatch> &second, vector<int> *reverse = 0) const;
+
+private:
+    void matchNearest(const Mat &query, vector<DMatch> &nearest, vector<DMatch> *second, vector<int> *reverse) const;
+
+    Mat trainDescr;
+};
+
+#endif
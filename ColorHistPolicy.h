@@ -0,0 +1,165 @@
+/*
+ColorHistPolicy.h
+
+Descriptor policy (SIFTCore.h) of the RGB color histogram descriptors. Every sample of the
+descriptor window votes for the BUCKETS^3 color buckets of the BGR pyramid instead of for
+orientation bins. ColorHistSIFT uses 2 or 3 buckets per axis; NEWSIFT is the 2-bucket
+descriptor.
+*/
+
+#ifndef COLOR_HIST_POLICY_H
+#define COLOR_HIST_POLICY_H
+
+#include "SIFTCore.h"
+#include <algorithm>
+
+namespace cv
+{
+	// Adds the votes of one sample to the N color buckets of the four spatial bins around it.
+	// h: first bucket of the top-left spatial bin
+	// rowStep, colStep: distance in floats to the next spatial row and column
+	// w: weights of the N color buckets
+	// v00, v01, v10, v11: spatial weights of the top-left, top-right, bottom-left and bottom-right bins
+	template <int N>
+	static inline void voteColorBuckets(float* h, int rowStep, int colStep, const float* w,
+		float v00, float v01, float v10, float v11)
+	{
+		float* h01 = h + colStep;
+		float* h10 = h + rowStep;
+		float* h11 = h10 + colStep;
+		int b = 0;
+#if CV_AVX
+		__m256 s00 = _mm256_set1_ps(v00), s01 = _mm256_set1_ps(v01);
+		__m256 s10 = _mm256_set1_ps(v10), s11 = _mm256_set1_ps(v11);
+		for (; b <= N - 8; b += 8)
+		{
+			__m256 w8 = _mm256_loadu_ps(w + b);
+			_mm256_storeu_ps(h + b, _mm256_add_ps(_mm256_loadu_ps(h + b), _mm256_mul_ps(s00, w8)));
+			_mm256_storeu_ps(h01 + b, _mm256_add_ps(_mm256_loadu_ps(h01 + b), _mm256_mul_ps(s01, w8)));
+			_mm256_storeu_ps(h10 + b, _mm256_add_ps(_mm256_loadu_ps(h10 + b), _mm256_mul_ps(s10, w8)));
+			_mm256_storeu_ps(h11 + b, _mm256_add_ps(_mm256_loadu_ps(h11 + b), _mm256_mul_ps(s11, w8)));
+		}
+#elif CV_SSE2
+		__m128 s00 = _mm_set1_ps(v00), s01 = _mm_set1_ps(v01);
+		__m128 s10 = _mm_set1_ps(v10), s11 = _mm_set1_ps(v11);
+		for (; b <= N - 4; b += 4)
+		{
+			__m128 w4 = _mm_loadu_ps(w + b);
+			_mm_storeu_ps(h + b, _mm_add_ps(_mm_loadu_ps(h + b), _mm_mul_ps(s00, w4)));
+			_mm_storeu_ps(h01 + b, _mm_add_ps(_mm_loadu_ps(h01 + b), _mm_mul_ps(s01, w4)));
+			_mm_storeu_ps(h10 + b, _mm_add_ps(_mm_loadu_ps(h10 + b), _mm_mul_ps(s10, w4)));
+			_mm_storeu_ps(h11 + b, _mm_add_ps(_mm_loadu_ps(h11 + b), _mm_mul_ps(s11, w4)));
+		}
+#endif
+		for (; b < N; b++)
+		{
+			h[b] += v00 * w[b];
+			h01[b] += v01 * w[b];
+			h10[b] += v10 * w[b];
+			h11[b] += v11 * w[b];
+		}
+	}
+
+	// Splits a color value between the two nearest of BUCKETS equal buckets along its axis. Values
+	// below the center of the first bucket or above the center of the last go to it alone
+	template <int BUCKETS>
+	static inline void colorAxisWeights(int value, float* weight)
+	{
+		const double width = 256.0 / BUCKETS;
+		double pos = std::min(std::max((value - (width * 0.5 - 0.5)) / width, 0.0), (double)(BUCKETS - 1));
+		int b0 = std::min((int)pos, BUCKETS - 2);
+		for (int b = 0; b < BUCKETS; b++)
+			weight[b] = 0.f;
+		weight[b0] = (float)(1.0 - (pos - b0));
+		weight[b0 + 1] = (float)(1.0 - weight[b0]);
+	}
+
+	// Every sample votes for the BUCKETS^3 RGB color buckets of the BGR pyramid, softly assigned
+	// along each color axis. The votes are not weighted by the Gaussian window
+	template <int BUCKETS>
+	struct ColorHistPolicy
+	{
+		static const ScaleSpace::Pyramid PYRAMID = ScaleSpace::BGR;
+		// red, green and blue
+		static const int CHANNELS = 3;
+		// RGB color buckets
+		static const int BINS = BUCKETS * BUCKETS * BUCKETS;
+		static const int PARTS = 1;
+		static const bool WEIGHTED = false;
+		static const bool DENSE_MAP = false;
+
+		template <typename T>
+		static inline void sampleRow(const Mat& img, int r, int x, int j0, int j1, float* const* ch, int k)
+		{
+			const float scale = 1.f / PyramidScale<T>::INTENSITY;
+			const Vec<T, 3>* imgRow = img.ptr<Vec<T, 3> >(r) + x;
+			float *RedBin = ch[0], *GreenBin = ch[1], *BlueBin = ch[2];
+			for (int j = j0; j <= j1; j++, k++)
+			{
+				//changes: color histogram
+				const Vec<T, 3>& bgr = imgRow[j];
+				//stores RGB info
+				RedBin[k] = bgr[2] * scale;
+				GreenBin[k] = bgr[1] * scale;
+				BlueBin[k] = bgr[0] * scale;
+			}
+		}
+
+		static inline void prepare(float* const*, int)
+		{
+		}
+
+		// Bucket index with 2 buckets per axis:
+		// 0 : 0 <= red <= 127; 0 <= green <= 127; 0 <= blue <= 127
+		// 1 : 0 <= red <= 127; 0 <= green <= 127; 128 <= blue <= 255
+		// 2 : 0 <= red <= 127; 128 <= green <= 255; 0 <= blue <= 127
+		// 3 : 0 <= red <= 127; 128 <= green <= 255; 128 <= blue <= 255
+		// 4 : 128 <= red <= 255; 0 <= green <= 127; 0 <= blue <= 127
+		// 5 : 128 <= red <= 255; 0 <= green <= 127; 128 <= blue <= 255
+		// 6 : 128 <= red <= 255; 128 <= green <= 255; 0 <= blue <= 127
+		// 7 : 128 <= red <= 255; 128 <= green <= 255; 128 <= blue <= 255
+		/*
+			How this works:
+				we have RGB(three dimensions) and each dimensions are divided into 2 parts.
+				Thus, we can think about this in an abstract way: we represent R G B as a 3bits
+				binary number(with R at most significantbit and B at least significant bit).
+				When a color value(any one of the RGB) falls into 0<= value <=127,we consider that as a 0 bit,
+				When a color value(any one of the RGB) falls into 127<= value <=255, we consider that as a 1 bit.
+				Now 3 bits (0-7) can be fully mapped to our 8 color buckets
+			With more buckets per axis the digits are base BUCKETS: (red * BUCKETS + green) * BUCKETS + blue
+		*/
+		template <int D>
+		static inline void vote(float* hist, const float* const* ch, float w, int k,
+			int r0, int c0, float rbin, float cbin, float)
+		{
+			const int d = D, n = BINS;
+
+			// weight of each color value for keypoint pixel k along its axis
+			float rWeight[BUCKETS], gWeight[BUCKETS], bWeight[BUCKETS];
+			colorAxisWeights<BUCKETS>((int)ch[0][k], rWeight);
+			colorAxisWeights<BUCKETS>((int)ch[1][k], gWeight);
+			colorAxisWeights<BUCKETS>((int)ch[2][k], bWeight);
+			// weight of each bucket. With 2 buckets per axis the channel weights are multiples
+			// of 1/256, so these products are exact
+			float bucketWeight[BINS];
+			for (int r = 0; r < BUCKETS; r++)
+				for (int g = 0; g < BUCKETS; g++)
+					for (int b = 0; b < BUCKETS; b++)
+						bucketWeight[(r * BUCKETS + g) * BUCKETS + b] = rWeight[r] * gWeight[g] * bWeight[b];
+
+			//// histogram update using tri-linear interpolation
+			// vote is weighted by 1 in colo histogram
+			// (while vote is weighted by gradient magnitude in grediant orientation histogram)
+
+			float v_r1 = w*rbin, v_r0 = w - v_r1;
+			float v_rc11 = v_r1*cbin, v_rc10 = v_r1 - v_rc11;
+			float v_rc01 = v_r0*cbin, v_rc00 = v_r0 - v_rc01;
+
+			int idx = ((r0 + 1)*(d + 2) + c0 + 1)*(n + 2);
+			voteColorBuckets<BINS>(hist + idx, (d + 2)*(n + 2), n + 2, bucketWeight,
+				v_rc00, v_rc01, v_rc10, v_rc11);
+		}
+	};
+}
+
+#endif
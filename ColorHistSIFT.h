@@ -50,6 +50,7 @@
 #include "opencv2/features2d/features2d.hpp"
 #include "opencv2/opencv.hpp"
 #include "opencv2\core\mat.hpp"
+#include "SIFTCore.h"
 #include <algorithm>
 using namespace std;
 using namespace cv;
@@ -67,23 +68,39 @@ namespace cv
 	public:
 		CV_WRAP static Ptr<ColorHistSIFT> create(int nfeatures = 0, int nOctaveLayers = 3,
 			double contrastThreshold = 0.04, double edgeThreshold = 10,
-			double sigma = 1.6)
+			double sigma = 1.6, int descriptorType = CV_32F)
 		{
 			return makePtr<ColorHistSIFT>(
 				ColorHistSIFT(nfeatures, nOctaveLayers,
 				contrastThreshold, edgeThreshold,
-				sigma));
+				sigma, descriptorType));
 		};
 		CV_WRAP explicit ColorHistSIFT(int nfeatures = 0, int nOctaveLayers = 3,
 			double contrastThreshold = 0.04, double edgeThreshold = 10,
-			double sigma = 1.6);
+			double sigma = 1.6, int descriptorType = CV_32F);
 
-		//! returns the descriptor size in floats (128)
+		//! returns the descriptor size in floats (128 with the default geometry)
 		CV_WRAP int descriptorSize() const;
 
-		//! returns the descriptor type
+		//! returns the descriptor type, CV_32F or CV_8U as chosen at construction. Both hold the
+		//! same integer values in [0, 255]; CV_8U stores them in a quarter of the memory
 		CV_WRAP int descriptorType() const;
-		
+
+		//! sets the number of threads computing descriptors: 1 runs serially, 0 lets OpenCV
+		//! decide. The descriptors are identical for every setting
+		CV_WRAP void setNumThreads(int nThreads);
+		CV_WRAP int getNumThreads() const;
+
+		//! sets the width of the descriptor's spatial histogram array, 4 (the default) or 2.
+		//! A width of 2 gives descriptors a quarter the size, for faster matching
+		CV_WRAP void setDescriptorWidth(int descrWidth);
+		CV_WRAP int getDescriptorWidth() const;
+
+		//! sets the number of color buckets along each of the RGB axes, 2 (the default, 8
+		//! buckets per spatial bin) or 3 (27 buckets per spatial bin)
+		CV_WRAP void setBucketsPerChannel(int buckets);
+		CV_WRAP int getBucketsPerChannel() const;
+
 		//! finds the keypoints using SIFT algorithm
 		void operator()(InputArray img, InputArray mask,
 			vector<KeyPoint>& keypoints) const;
@@ -94,8 +111,16 @@ namespace cv
 			OutputArray descriptors,
 			bool useProvidedKeypoints = false) const;
 
-		void buildGaussianPyramid(const Mat& base, vector<Mat>& pyr, int nOctaves) const;
-		void buildDoGPyramid(const vector<Mat>& pyr, vector<Mat>& dogpyr) const;
+		//! same as above, but works on the pyramids of a scale space shared with other
+		//! extractors, building only the levels that are actually needed. scratchBytes, if
+		//! given, receives the heap bytes the descriptor scratch buffers allocated during this
+		//! call; 0 once the buffers have grown to the largest keypoint radius
+		void operator()(ScaleSpace& scaleSpace, InputArray mask,
+			vector<KeyPoint>& keypoints,
+			OutputArray descriptors,
+			bool useProvidedKeypoints = false,
+			size_t* scratchBytes = 0) const;
+
 		void findScaleSpaceExtrema(const vector<Mat>& gauss_pyr, const vector<Mat>& dog_pyr,
 			vector<KeyPoint>& keypoints) const;
 
@@ -117,6 +142,13 @@ namespace cv
 		CV_PROP_RW double contrastThreshold;
 		CV_PROP_RW double edgeThreshold;
 		CV_PROP_RW double sigma;
+		CV_PROP_RW int nThreads;
+		CV_PROP_RW int descType;
+		CV_PROP_RW int descrWidth;
+		CV_PROP_RW int buckets;
+
+		// per-thread scratch memory of the descriptor kernels, reused across keypoints and images
+		Ptr<DescriptorScratchArena> scratch;
 	};
 
 	//typedef NEWSIFT NewSiftFeatureDetector;
@@ -0,0 +1,119 @@
+/*
+DescriptorSampling.h
+
+Sampling stage shared by the per-keypoint descriptor kernels (calcNEWSIFTDescriptor).
+The descriptor window is a square rotated by the keypoint orientation, which covers only
+about half of the (2 * radius + 1)^2 patch that encloses it. Instead of testing every pixel
+of the patch, the kernels ask for the exact span of columns that falls inside the window on
+each patch row and fill the bin coordinates of that span in one pass.
+*/
+
+#ifndef DESCRIPTOR_SAMPLING_H
+#define DESCRIPTOR_SAMPLING_H
+
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace cv
+{
+	// True if the sample at patch offset (i, j) falls inside the descriptor window, that is if
+	// its rotated histogram coordinates rbin and cbin both lie in (-1, d). Evaluated exactly
+	// like descriptorRowBins so that both agree on every sample
+	static inline bool inDescriptorWindow(int i, int j, float cos_t, float sin_t, int d)
+	{
+		float c_rot = j * cos_t - i * sin_t;
+		float r_rot = j * sin_t + i * cos_t;
+		float rbin = r_rot + d / 2 - 0.5f;
+		float cbin = c_rot + d / 2 - 0.5f;
+		return rbin > -1 && rbin < d && cbin > -1 && cbin < d;
+	}
+
+	// Narrows [jmin, jmax] to the j for which lo < a * j + b < hi. Computed in double, so the
+	// result may be one column off the float test at either end
+	static inline void clipLinearSpan(double a, double b, double lo, double hi, int& jmin, int& jmax)
+	{
+		if (a == 0)
+		{
+			if (b <= lo || b >= hi)
+				jmax = jmin - 1;
+			return;
+		}
+		double j0 = (lo - b) / a, j1 = (hi - b) / a;
+		if (a < 0)
+			std::swap(j0, j1);
+		jmin = std::max(jmin, (int)std::floor(j0));
+		jmax = std::min(jmax, (int)std::ceil(j1));
+	}
+
+	// Finds the columns of patch row i that are inside the descriptor window.
+	// i: row offset from the keypoint
+	// jlo, jhi: range of column offsets to consider (the patch and the valid image columns)
+	// cos_t, sin_t: orientation of the window, already divided by the histogram width
+	// d: descr_width
+	// j0, j1: first and last column inside the window
+	// Returns false if the row has no sample inside the window.
+	// rbin and cbin are monotonic in j, so the samples inside form one contiguous span
+	static inline bool descriptorRowSpan(int i, int jlo, int jhi, float cos_t, float sin_t, int d,
+		int& j0, int& j1)
+	{
+		double lo = -1 - (d / 2 - 0.5), hi = d - (d / 2 - 0.5);
+		j0 = jlo; j1 = jhi;
+		// r_rot = j * sin_t + i * cos_t and c_rot = j * cos_t - i * sin_t
+		clipLinearSpan(sin_t, (double)i * cos_t, lo, hi, j0, j1);
+		clipLinearSpan(cos_t, -(double)i * sin_t, lo, hi, j0, j1);
+		j0 = std::max(j0, jlo);
+		j1 = std::min(j1, jhi);
+
+		// settle the ends with the exact float test
+		while (j0 <= j1 && !inDescriptorWindow(i, j0, cos_t, sin_t, d))
+			j0++;
+		while (j0 <= j1 && !inDescriptorWindow(i, j1, cos_t, sin_t, d))
+			j1--;
+		if (j0 > j1)
+			return false;
+		while (j0 > jlo && inDescriptorWindow(i, j0 - 1, cos_t, sin_t, d))
+			j0--;
+		while (j1 < jhi && inDescriptorWindow(i, j1 + 1, cos_t, sin_t, d))
+			j1++;
+		return true;
+	}
+
+	// Writes the rotated histogram coordinates of the samples j0..j1 of patch row i to
+	// RBin and CBin and, if W is not null, their gaussian weight exponents
+	// (c_rot^2 + r_rot^2) * exp_scale. Results are identical to the per-sample scalar formula
+	static inline void descriptorRowBins(int i, int j0, int j1, float cos_t, float sin_t, int d,
+		float exp_scale, float* RBin, float* CBin, float* W)
+	{
+		float icos = i * cos_t, isin = i * sin_t, off = (float)(d / 2);
+		int j = j0, k = 0;
+#if CV_SSE2
+		__m128 vcos = _mm_set1_ps(cos_t), vsin = _mm_set1_ps(sin_t);
+		__m128 vicos = _mm_set1_ps(icos), visin = _mm_set1_ps(isin);
+		__m128 voff = _mm_set1_ps(off), vhalf = _mm_set1_ps(0.5f), vexp = _mm_set1_ps(exp_scale);
+		__m128i vj = _mm_setr_epi32(j0, j0 + 1, j0 + 2, j0 + 3), four = _mm_set1_epi32(4);
+		for (; j <= j1 - 3; j += 4, k += 4)
+		{
+			__m128 fj = _mm_cvtepi32_ps(vj);
+			__m128 c_rot = _mm_sub_ps(_mm_mul_ps(fj, vcos), visin);
+			__m128 r_rot = _mm_add_ps(_mm_mul_ps(fj, vsin), vicos);
+			_mm_storeu_ps(RBin + k, _mm_sub_ps(_mm_add_ps(r_rot, voff), vhalf));
+			_mm_storeu_ps(CBin + k, _mm_sub_ps(_mm_add_ps(c_rot, voff), vhalf));
+			if (W)
+				_mm_storeu_ps(W + k, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(c_rot, c_rot), _mm_mul_ps(r_rot, r_rot)), vexp));
+			vj = _mm_add_epi32(vj, four);
+		}
+#endif
+		for (; j <= j1; j++, k++)
+		{
+			float c_rot = j * cos_t - isin;
+			float r_rot = j * sin_t + icos;
+			RBin[k] = r_rot + off - 0.5f;
+			CBin[k] = c_rot + off - 0.5f;
+			if (W)
+				W[k] = (c_rot * c_rot + r_rot * r_rot)*exp_scale;
+		}
+	}
+}
+
+#endif
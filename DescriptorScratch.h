@@ -0,0 +1,72 @@
+/*
+DescriptorScratch.h
+
+Reusable scratch memory for the per-keypoint descriptor kernels (calcNEWSIFTDescriptor).
+Every thread gets its own buffer, which only ever grows, so once it is as large as the
+biggest keypoint radius seen so far the kernels do not touch the heap any more.
+*/
+
+#ifndef DESCRIPTOR_SCRATCH_H
+#define DESCRIPTOR_SCRATCH_H
+
+#include "opencv2/opencv.hpp"
+#include <atomic>
+#include <vector>
+using namespace std;
+
+namespace cv
+{
+	class DescriptorScratchArena
+	{
+	public:
+		DescriptorScratchArena() {}
+
+		// Returns room for at least n floats that belongs to the calling thread, adding what
+		// had to be allocated for it to bytesAllocated. The contents are left over from the
+		// previous call
+		float* buffer(size_t n, atomic<size_t>& bytesAllocated)
+		{
+			vector<float>& buf = tls.get()->buf;
+			if (buf.size() < n)
+			{
+				// allocate exactly what is needed; the largest radius sets the final size
+				vector<float>(n).swap(buf);
+				bytesAllocated += n * sizeof(float);
+			}
+			return &buf[0];
+		}
+
+	private:
+		struct Buffer
+		{
+			vector<float> buf;
+		};
+
+		TLSData<Buffer> tls;
+
+		DescriptorScratchArena(const DescriptorScratchArena&);
+		DescriptorScratchArena& operator=(const DescriptorScratchArena&);
+	};
+
+	// The scratch memory of one descriptor computation: buffers from an arena that may be
+	// shared with concurrent computations, and the bytes this computation alone made the arena
+	// allocate, on whichever threads it ran
+	class DescriptorScratch
+	{
+	public:
+		explicit DescriptorScratch(DescriptorScratchArena& _arena) : arena(_arena), bytesAllocated(0) {}
+
+		float* buffer(size_t n) { return arena.buffer(n, bytesAllocated); }
+
+		size_t allocatedBytes() const { return bytesAllocated; }
+
+	private:
+		DescriptorScratchArena& arena;
+		atomic<size_t> bytesAllocated;
+
+		DescriptorScratch(const DescriptorScratch&);
+		DescriptorScratch& operator=(const DescriptorScratch&);
+	};
+}
+
+#endif
@@ -0,0 +1,334 @@
+/*
+DescriptorStore.cpp
+
+A binary, memory-mappable container for the keypoints and descriptors of a set of images.
+*/
+
+#include "DescriptorStore.h"
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Every keypoint and descriptor block starts at a multiple of this many bytes
+static const size_t BLOCK_ALIGN = 64;
+
+static const char MAGIC[8] = { 'C', 'H', 'D', 'S', 'T', 'O', 'R', 'E' };
+
+struct DescriptorStore::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numImages;
+    uint64_t fileSize;
+    uint64_t reserved;
+};
+
+struct DescriptorStore::Entry {
+    uint64_t nameOffset;
+    uint64_t keyPointOffset;
+    uint64_t descriptorOffset;
+    uint32_t nameLength;
+    uint32_t numKeyPoints;
+    uint32_t descriptorRows;
+    uint32_t descriptorCols;
+    int32_t descriptorType;
+    // Bytes per descriptor row
+    uint32_t descriptorStep;
+};
+
+// A keypoint as stored in the file
+struct StoredKeyPoint {
+    float x, y, size, angle, response;
+    int32_t octave, classId;
+};
+
+static size_t alignBlock(size_t offset)
+{
+    return (offset + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+}
+
+// Image name without its extension, as the XML writers store it
+static string baseName(const string &imgName)
+{
+    return imgName.substr(0, imgName.rfind('.'));
+}
+
+DescriptorStore::DescriptorStore() : base(0), length(0), fileHandle(0), mapHandle(0)
+{
+}
+
+DescriptorStore::~DescriptorStore()
+{
+    close();
+}
+
+// Writes the keypoints and descriptors of numImgs images to a store file
+void DescriptorStore::write(const string &filename, const string *imgNames, const vector<KeyPoint> *kpts, const Mat *descriptors, int numImgs)
+{
+    // Lay out the file: header, index, names, then the aligned blocks of every image
+    vector<Entry> entries(numImgs);
+    vector<string> names(numImgs);
+    size_t offset = sizeof(Header) + numImgs * sizeof(Entry);
+    for (int i = 0; i < numImgs; ++i) {
+        names[i] = baseName(imgNames[i]);
+        entries[i].nameOffset = offset;
+        entries[i].nameLength = (uint32_t)names[i].size();
+        offset += names[i].size();
+    }
+    for (int i = 0; i < numImgs; ++i) {
+        const Mat &descr = descriptors[i];
+        CV_Assert(descr.empty() || descr.dims == 2);
+        Entry &e = entries[i];
+        e.numKeyPoints = (uint32_t)kpts[i].size();
+        e.descriptorRows = (uint32_t)descr.rows;
+        e.descriptorCols = (uint32_t)descr.cols;
+        e.descriptorType = descr.empty() ? CV_32F : descr.type();
+        e.descriptorStep = (uint32_t)(descr.cols * CV_ELEM_SIZE(e.descriptorType));
+
+        offset = alignBlock(offset);
+        e.keyPointOffset = offset;
+        offset += e.numKeyPoints * sizeof(StoredKeyPoint);
+        offset = alignBlock(offset);
+        e.descriptorOffset = offset;
+        offset += (size_t)e.descriptorRows * e.descriptorStep;
+    }
+
+    Header header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.numImages = (uint32_t)numImgs;
+    header.fileSize = offset;
+    header.reserved = 0;
+
+    ofstream out(filename.c_str(), ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        CV_Error(CV_StsError, "Unable to create descriptor store " + filename);
+    }
+    out.write((const char *)&header, sizeof(header));
+    if (numImgs > 0) {
+        out.write((const char *)&entries[0], numImgs * sizeof(Entry));
+    }
+    for (int i = 0; i < numImgs; ++i) {
+        out.write(names[i].data(), names[i].size());
+    }
+
+    const char padding[BLOCK_ALIGN] = { 0 };
+    vector<StoredKeyPoint> stored;
+    for (int i = 0; i < numImgs; ++i) {
+        const Entry &e = entries[i];
+        out.write(padding, e.keyPointOffset - (size_t)out.tellp());
+
+        stored.resize(e.numKeyPoints);
+        for (size_t k = 0; k < stored.size(); ++k) {
+            const KeyPoint &kpt = kpts[i][k];
+            StoredKeyPoint &s = stored[k];
+            s.x = kpt.pt.x;
+            s.y = kpt.pt.y;
+            s.size = kpt.size;
+            s.angle = kpt.angle;
+            s.response = kpt.response;
+            s.octave = kpt.octave;
+            s.classId = kpt.class_id;
+        }
+        if (!stored.empty()) {
+            out.write((const char *)&stored[0], stored.size() * sizeof(StoredKeyPoint));
+        }
+
+        out.write(padding, e.descriptorOffset - (size_t)out.tellp());
+        for (uint32_t r = 0; r < e.descriptorRows; ++r) {
+            out.write((const char *)descriptors[i].ptr((int)r), e.descriptorStep);
+        }
+    }
+
+    if (!out.good()) {
+        CV_Error(CV_StsError, "Unable to write descriptor store " + filename);
+    }
+}
+
+// Maps a store file for reading
+void DescriptorStore::open(const string &filename)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        CV_Error(CV_StsError, "Unable to open descriptor store " + filename);
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    HANDLE mapping = fileSize.QuadPart > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    const void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!view) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        CV_Error(CV_StsError, "Unable to map descriptor store " + filename);
+    }
+    fileHandle = file;
+    mapHandle = mapping;
+    length = (size_t)fileSize.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        CV_Error(CV_StsError, "Unable to open descriptor store " + filename);
+    }
+    struct stat st;
+    void *view = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        view = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    // The mapping stays valid once the descriptor is closed
+    ::close(fd);
+    if (view == MAP_FAILED) {
+        CV_Error(CV_StsError, "Unable to map descriptor store " + filename);
+    }
+    length = (size_t)st.st_size;
+#endif
+    base = (const uchar *)view;
+
+    // Validate the header and every index entry, so that the accessors can trust the offsets
+    const Header *header = (const Header *)base;
+    string problem;
+    if (length < sizeof(Header) || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+        problem = "is not a descriptor store";
+    }
+    else if (header->version != VERSION) {
+        problem = "has an unsupported version";
+    }
+    else if (header->fileSize != length || (length - sizeof(Header)) / sizeof(Entry) < header->numImages) {
+        problem = "is truncated";
+    }
+    for (int i = 0; problem.empty() && i < (int)header->numImages; ++i) {
+        const Entry &e = entry(i);
+        size_t elemSize = CV_ELEM_SIZE(e.descriptorType);
+        bool ok = e.nameOffset <= length && e.nameLength <= length - e.nameOffset
+            && e.keyPointOffset % BLOCK_ALIGN == 0 && e.keyPointOffset <= length
+            && e.numKeyPoints <= (length - e.keyPointOffset) / sizeof(StoredKeyPoint)
+            && e.descriptorOffset % BLOCK_ALIGN == 0 && e.descriptorOffset <= length
+            && (uint64_t)e.descriptorCols * elemSize == e.descriptorStep
+            && (e.descriptorStep == 0 || e.descriptorRows <= (length - e.descriptorOffset) / e.descriptorStep);
+        if (!ok) {
+            problem = "has a corrupt index";
+        }
+    }
+    if (!problem.empty()) {
+        close();
+        CV_Error(CV_StsError, "File " + filename + " " + problem);
+    }
+}
+
+// Unmaps the file
+void DescriptorStore::close()
+{
+    if (!base) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle((HANDLE)mapHandle);
+    CloseHandle((HANDLE)fileHandle);
+#else
+    munmap((void *)base, length);
+#endif
+    base = 0;
+    length = 0;
+    fileHandle = mapHandle = 0;
+}
+
+int DescriptorStore::size() const
+{
+    return base ? (int)((const Header *)base)->numImages : 0;
+}
+
+const DescriptorStore::Entry &DescriptorStore::entry(int i) const
+{
+    CV_Assert(0 <= i && i < size());
+    return ((const Entry *)(base + sizeof(Header)))[i];
+}
+
+string DescriptorStore::name(int i) const
+{
+    const Entry &e = entry(i);
+    return string((const char *)base + e.nameOffset, e.nameLength);
+}
+
+int DescriptorStore::find(const string &imgName) const
+{
+    for (int i = 0; i < size(); ++i) {
+        const Entry &e = entry(i);
+        if (e.nameLength == imgName.size() && memcmp(base + e.nameOffset, imgName.data(), e.nameLength) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Descriptors of image i, pointing into the mapped file
+Mat DescriptorStore::descriptors(int i) const
+{
+    const Entry &e = entry(i);
+    if (e.descriptorRows == 0) {
+        return Mat();
+    }
+    return Mat((int)e.descriptorRows, (int)e.descriptorCols, e.descriptorType, (void *)(base + e.descriptorOffset), e.descriptorStep);
+}
+
+vector<KeyPoint> DescriptorStore::keyPoints(int i) const
+{
+    const Entry &e = entry(i);
+    const StoredKeyPoint *stored = (const StoredKeyPoint *)(base + e.keyPointOffset);
+    vector<KeyPoint> kpts(e.numKeyPoints);
+    for (size_t k = 0; k < kpts.size(); ++k) {
+        const StoredKeyPoint &s = stored[k];
+        kpts[k] = KeyPoint(s.x, s.y, s.size, s.angle, s.response, s.octave, s.classId);
+    }
+    return kpts;
+}
+
+// Builds a store from the XML written by writeKeyPoints and writeDescriptors
+void DescriptorStore::fromXml(const string &kptsFile, const string &descriptorsFile, const string &filename)
+{
+    FileStorage kptsFs(kptsFile, FileStorage::READ);
+    FileStorage descrFs(descriptorsFile, FileStorage::READ);
+    if (!kptsFs.isOpened() || !descrFs.isOpened()) {
+        CV_Error(CV_StsError, "Unable to read " + kptsFile + " or " + descriptorsFile);
+    }
+
+    vector<string> names;
+    vector<vector<KeyPoint> > kpts;
+    vector<Mat> descriptors;
+    FileNode root = descrFs.root();
+    for (FileNodeIterator it = root.begin(); it != root.end(); ++it) {
+        names.push_back((*it).name());
+        kpts.push_back(vector<KeyPoint>());
+        descriptors.push_back(Mat());
+        read(kptsFs[names.back()], kpts.back());
+        read(*it, descriptors.back());
+    }
+
+    int numImgs = (int)names.size();
+    write(filename, numImgs ? &names[0] : 0, numImgs ? &kpts[0] : 0, numImgs ? &descriptors[0] : 0, numImgs);
+}
+
+// Writes the keypoints and descriptors of the open store to XML files
+void DescriptorStore::toXml(const string &kptsFile, const string &descriptorsFile) const
+{
+    FileStorage kptsFs(kptsFile, FileStorage::WRITE);
+    FileStorage descrFs(descriptorsFile, FileStorage::WRITE);
+    for (int i = 0; i < size(); ++i) {
+        cv::write(kptsFs, name(i), keyPoints(i));
+        cv::write(descrFs, name(i), descriptors(i));
+    }
+}
@@ -0,0 +1,81 @@
+/*
+DescriptorStore.h
+
+A binary container for the keypoints and descriptors of a set of images, replacing the
+FileStorage XML files for anything large. The file is laid out so that it can be memory
+mapped and one image's descriptors used in place, without parsing or copying the rest:
+
+    header      magic "CHDSTORE", format version, number of images, file size
+    index       one fixed-size entry per image: name, keypoint block and descriptor block
+    names       the image names, back to back
+    blocks      per image, its keypoints then its descriptor rows, each block 64-byte aligned
+
+All values are stored in the byte order of the machine that wrote the file (little endian on
+every platform this project builds on). Version 1 is the only version so far.
+*/
+
+#ifndef DESCRIPTOR_STORE_H
+#define DESCRIPTOR_STORE_H
+
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace cv;
+
+class DescriptorStore
+{
+public:
+    // Current format version
+    static const uint32_t VERSION = 1;
+
+    DescriptorStore();
+    ~DescriptorStore();
+
+    // Writes the keypoints and descriptors of numImgs images to a store file. Image names are stored without their extension,
+    // as writeKeyPoints and writeDescriptors name them
+    static void write(const string &filename, const string *imgNames, const vector<KeyPoint> *kpts, const Mat *descriptors, int numImgs);
+
+    // Maps a store file for reading, closing any file opened before. Throws if the file is not a valid store
+    void open(const string &filename);
+    // Unmaps the file. Matrices returned by descriptors() must not be used after this
+    void close();
+    bool isOpen() const { return base != 0; }
+
+    // Number of images in the store
+    int size() const;
+    // Name of image i
+    string name(int i) const;
+    // Index of the image with the given name, or -1
+    int find(const string &imgName) const;
+
+    // Descriptors of image i. The matrix points into the mapped file (no copy) and is valid until close()
+    Mat descriptors(int i) const;
+    // Keypoints of image i
+    vector<KeyPoint> keyPoints(int i) const;
+
+    // Builds a store from the XML written by writeKeyPoints and writeDescriptors. Every image in the descriptor file is
+    // converted; its keypoints are looked up by name in the keypoint file
+    static void fromXml(const string &kptsFile, const string &descriptorsFile, const string &filename);
+    // Writes the keypoints and descriptors of the open store to XML files readable by readKeyPoints and readDescriptors
+    void toXml(const string &kptsFile, const string &descriptorsFile) const;
+
+private:
+    struct Header;
+    struct Entry;
+
+    const Entry &entry(int i) const;
+
+    // Mapped file
+    const uchar *base;
+    size_t length;
+    // Platform handles of the mapping
+    void *fileHandle;
+    void *mapHandle;
+
+    DescriptorStore(const DescriptorStore &);
+    DescriptorStore &operator=(const DescriptorStore &);
+};
+
+#endif
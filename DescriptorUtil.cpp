@@ -11,8 +11,14 @@ using namespace std;
 using namespace cv::xfeatures2d;
 
 // Constructor, initializes parameters to be used for the keypoint detectors and descriptor extractors
-DescriptorUtil::DescriptorUtil()
+DescriptorUtil::DescriptorUtil(int descriptorType) : numThreads(0), matcherType(FLANN_MATCHER), ratioTest(false), mutualCheck(false), pyramidDepth(CV_32F)
 {
+    // The extractors live as long as this object so that their scratch buffers are reused across images
+    siftExtractor = OPSIFT::create(0, 3, 0.04, 10, 1.6, descriptorType);
+    opponentExtractor = OPSIFT::create(0, 3, 0.04, 10, 1.6, descriptorType);
+    opponentExtractor->setOpponentColor(true);
+    colorHistExtractor = ColorHistSIFT::create(0, 3, 0.04, 10, 1.6, descriptorType);
+    hueSatExtractor = HueSatSIFT::create(0, 3, 0.04, 10, 1.6, descriptorType);
 }
 
 // Desctructor
@@ -20,16 +26,127 @@ DescriptorUtil::~DescriptorUtil()
 {
 }
 
+// Sets the number of threads each descriptor extractor uses: 1 runs serially, 0 lets OpenCV decide
+void DescriptorUtil::setNumThreads(int nThreads)
+{
+    numThreads = nThreads;
+    siftExtractor->setNumThreads(numThreads);
+    opponentExtractor->setNumThreads(numThreads);
+    colorHistExtractor->setNumThreads(numThreads);
+    hueSatExtractor->setNumThreads(numThreads);
+}
+
+// Lets the extractors that support it compute dense maps of densely sampled levels
+void DescriptorUtil::setDenseMaps(bool enabled)
+{
+    siftExtractor->setDenseMaps(enabled);
+    opponentExtractor->setDenseMaps(enabled);
+    hueSatExtractor->setDenseMaps(enabled);
+}
+
+// Selects the nearest-neighbour search used by match()
+void DescriptorUtil::setMatcher(MATCHER_TYPES type)
+{
+    matcherType = type;
+}
+
+// Selects between nearest-neighbour matching and the ratio test
+void DescriptorUtil::setRatioTest(bool enabled, bool mutual)
+{
+    ratioTest = enabled;
+    mutualCheck = mutual;
+}
+
+// Selects float or 16-bit fixed-point pyramids for the images processed from now on
+void DescriptorUtil::setFixedPointPyramids(bool enabled)
+{
+    pyramidDepth = enabled ? CV_16S : CV_32F;
+}
+
+// Caches the image's scale space until the last lease of the image ends
+DescriptorUtil::ScaleSpaceLease::ScaleSpaceLease(const DescriptorUtil &util, const Mat &img) : util(util), img(img)
+{
+    lock_guard<mutex> lock(util.scaleSpaceLock);
+    LeasedScaleSpace &entry = util.scaleSpaces[ImageKey(img)];
+    if (!entry.scaleSpace) {
+        entry.scaleSpace = makePtr<ScaleSpace>(img, -1, 3, 1.6, util.pyramidDepth);
+        entry.leases = 0;
+    }
+    ++entry.leases;
+}
+
+DescriptorUtil::ScaleSpaceLease::~ScaleSpaceLease()
+{
+    lock_guard<mutex> lock(util.scaleSpaceLock);
+    map<ImageKey, LeasedScaleSpace>::iterator it = util.scaleSpaces.find(ImageKey(img));
+    if (it != util.scaleSpaces.end() && --it->second.leases == 0) {
+        util.scaleSpaces.erase(it);
+    }
+}
+
+// Returns the scale space of a leased image, or else a new one that is not cached
+Ptr<ScaleSpace> DescriptorUtil::getScaleSpace(const Mat& img) const
+{
+    {
+        lock_guard<mutex> lock(scaleSpaceLock);
+        map<ImageKey, LeasedScaleSpace>::iterator it = scaleSpaces.find(ImageKey(img));
+        if (it != scaleSpaces.end()) {
+            return it->second.scaleSpace;
+        }
+    }
+    return makePtr<ScaleSpace>(img, -1, 3, 1.6, pyramidDepth);
+}
+
 // Detect features in an image using the SIFT feature detector. The keyPoints parameter will contain the key points detected
-void DescriptorUtil::detectFeatures(const Mat& img, vector<KeyPoint> &keyPoints)
+void DescriptorUtil::detectFeatures(const Mat& img, vector<KeyPoint> &keyPoints) const
+{
+    detectFeatures(*getScaleSpace(img), keyPoints);
+}
+
+// Detects features on a scale space
+void DescriptorUtil::detectFeatures(ScaleSpace& scaleSpace, vector<KeyPoint> &keyPoints) const
 {
     // Initialize SIFT feature detector
 	// opencv 2.x version
 	//SiftFeatureDetector siftDetector;
     //siftDetector.detect(img, keyPoints);
 	// opencv 3.0 version
-	Ptr<SIFT> sift = SIFT::create();
-	sift->detect(img, keyPoints);
+	//Ptr<SIFT> sift = SIFT::create();
+	//sift->detect(img, keyPoints);
+	// Same detector and defaults as SIFT::detect, but run on the image's scale space
+	// so that the descriptors can reuse its pyramids instead of building their own
+	Ptr<OPSIFT> sift = OPSIFT::create();
+	(*sift)(scaleSpace, noArray(), keyPoints, noArray());
+}
+
+// Lists the pyramids, besides the grey one, that the given descriptor types are computed from
+static vector<ScaleSpace::Pyramid> descriptorPyramids(const DescriptorType *types, int numTypes)
+{
+    vector<ScaleSpace::Pyramid> pyramids;
+    for (int i = 0; i < numTypes; ++i) {
+        DESC_TYPES parts[2] = { types[i].first, types[i].doubleDescriptor ? types[i].second : NONE };
+        for (int j = 0; j < 2; ++j) {
+            // Grey descriptors read the detection pyramid; SURF works on the image itself
+            if (parts[j] == COLOR_HIST_SIFT) {
+                pyramids.push_back(ScaleSpace::BGR);
+            }
+            else if (parts[j] == HUE_SAT_SIFT) {
+                pyramids.push_back(ScaleSpace::HSV);
+            }
+            else if (parts[j] == OPPONENT_SIFT) {
+                pyramids.push_back(ScaleSpace::OPPONENT);
+            }
+        }
+    }
+    return pyramids;
+}
+
+// Builds the image's detection pyramids and the pyramids its descriptor types read in one parallel pass, then detects features
+void DescriptorUtil::detectFeatures(const Mat& img, vector<KeyPoint> &keyPoints, const DescriptorType *types, int numTypes) const
+{
+    Ptr<ScaleSpace> scaleSpace = getScaleSpace(img);
+    scaleSpace->build(descriptorPyramids(types, numTypes), true, numThreads);
+    detectFeatures(*scaleSpace, keyPoints);
 }
 
 // Reads key points from a file
@@ -56,11 +173,29 @@ void DescriptorUtil::writeKeyPoints(vector<KeyPoint> *kpts, string *imgNames, in
 }
 
 // Computes the descriptors of a specified type for an image, given a set of keypoints
-Mat DescriptorUtil::computeDescriptors(Mat& img, vector<KeyPoint> &keypoints, DESC_TYPES type)
+Mat DescriptorUtil::computeDescriptors(Mat& img, vector<KeyPoint> &keypoints, DESC_TYPES type) const
 {
     Mat descriptors;
     vector<KeyPoint> kpts(keypoints.begin(), keypoints.end());
-    
+
+	// SURF Descriptor: descriptor size = 64
+	if (type == GRAY_SURF) {
+		//SurfDescriptorExtractor surfExtractor;
+		//surfExtractor.compute(img, kpts, descriptors);
+		Ptr<SURF> surf = SURF::create();
+		surf->compute(img, kpts, descriptors);
+	}
+	else {
+		descriptors = computeDescriptors(*getScaleSpace(img), kpts, type);
+	}
+
+    return descriptors;
+}
+
+// Computes SIFT-family descriptors of a specified type from a scale space
+Mat DescriptorUtil::computeDescriptors(ScaleSpace& scaleSpace, vector<KeyPoint> &kpts, DESC_TYPES type) const
+{
+    Mat descriptors;
 
     // Lowe's SIFT Descriptor: descriptor size = 128
     if (type == GRAY_SIFT) {
@@ -69,25 +204,19 @@ Mat DescriptorUtil::computeDescriptors(Mat& img, vector<KeyPoint> &keypoints, DE
         //SiftDescriptorExtractor siftExtractor;
 		//siftExtractor.compute(img, kpts, descriptors);
 		//opencv 3.0 version
-		Ptr<SIFT> sift = SIFT::create();
-		sift->compute(img, kpts, descriptors);
+		//Ptr<SIFT> sift = SIFT::create();
+		//sift->compute(img, kpts, descriptors);
+		// OPSIFT computes Lowe's grey descriptor on the shared grey pyramid
+		(*siftExtractor)(scaleSpace, noArray(), kpts, descriptors, true);
     }
-	// SURF Descriptor: descriptor size = 64
-	else if (type == GRAY_SURF) {
-		//SurfDescriptorExtractor surfExtractor;
-		//surfExtractor.compute(img, kpts, descriptors);
-		Ptr<SURF> surf = SURF::create();
-		surf->compute(img, kpts, descriptors);
-	}
-	// Opponent SIFT: descriptor size = 384	... WHY IS THIS CRASHING?
+	// Opponent SIFT: descriptor size = 384, Lowe's descriptor of each opponent color channel
 	else if (type == OPPONENT_SIFT) {
 		//Ptr<DescriptorExtractor> siftExtractor = new SiftDescriptorExtractor;
 		//OpponentColorDescriptorExtractor opponentExtractor(siftExtractor);
 		//opponentExtractor.compute(img, kpts, descriptors);
 		//Ptr<DescriptorExtractor> oppDescExtractor = new SiftDescriptorExtractor(;
 		//cv::oppo opponentDescExtractor(oppDescExtractor);
-		Ptr<OPSIFT>opsift = OPSIFT::create();
-		opsift->compute(img, kpts, descriptors);
+		(*opponentExtractor)(scaleSpace, noArray(), kpts, descriptors, true);
 	}
 	// Color histogram SIFT : descriptor size = 128
 	else if (type == COLOR_HIST_SIFT) {
@@ -95,8 +224,7 @@ Mat DescriptorUtil::computeDescriptors(Mat& img, vector<KeyPoint> &keypoints, DE
 		//NewSiftDescriptorExtractor newSiftExtractor;
 		//newSiftExtractor.compute(img, kpts, descriptors);
 		//3.0 version
-		Ptr<ColorHistSIFT> chSIFT = ColorHistSIFT::create();
-		chSIFT->compute(img, kpts, descriptors);
+		(*colorHistExtractor)(scaleSpace, noArray(), kpts, descriptors, true);
 	}
 	// Hue weighted by saturation SIFT : descriptor size = 128
 	else if (type == HUE_SAT_SIFT) {
@@ -104,100 +232,188 @@ Mat DescriptorUtil::computeDescriptors(Mat& img, vector<KeyPoint> &keypoints, DE
 		//NewSiftDescriptorExtractor newSiftExtractor;
 		//newSiftExtractor.compute(img, kpts, descriptors);
 		//3.0 version
-		Ptr<HueSatSIFT> hsSIFT = HueSatSIFT::create();
-		hsSIFT->compute(img, kpts, descriptors);
+		(*hueSatExtractor)(scaleSpace, noArray(), kpts, descriptors, true);
 	}
 	else if (type == NONE) { }
 
     return descriptors;
 }
 
-// Merge two descriptor types. There should be an equal number of descriptors in the matrices
-Mat DescriptorUtil::mergeDescriptors(Mat& descr1, Mat& descr2)
+// Detects keypoints and computes their descriptors tile by tile, holding the pyramids of one tile at a time
+void DescriptorUtil::detectAndComputeTiled(const Mat& img, const DescriptorType& type, vector<KeyPoint> &keyPoints, Mat& descriptors,
+    int tileSize, int nOctaves)
 {
-    Mat descriptors(0, descr1.cols + descr2.cols, descr1.type());
-
-    if (descr1.rows == descr2.rows) {
-        vector<float> mergedRow;
-        for (int i = 0; i < descr1.rows; ++i) {
-            // Get the corresponding rows
-            Mat m1 = descr1.row(i);
-            Mat m2 = descr2.row(i);
-            for (int j = 0; j < descr1.cols; ++j) {
-                mergedRow.push_back(m1.at<float>(j));
+    DESC_TYPES parts[2] = { type.first, type.doubleDescriptor ? type.second : NONE };
+    if (parts[0] == GRAY_SURF || parts[1] == GRAY_SURF)
+        CV_Error(CV_StsBadArg, "tiled extraction supports the SIFT-family descriptors only");
+    CV_Assert(tileSize > 0 && nOctaves > 0);
+
+    // The parameters of the default detector, which doubles the image
+    const int firstOctave = -1, nOctaveLayers = 3;
+    const double sigma = 1.6;
+    nOctaves = std::min(nOctaves, ScaleSpace::octaveCount(img.size(), firstOctave));
+
+    // The margin must hold the widest descriptor any extractor computes. Tiles start on multiples of the alignment,
+    // and so do their margins
+    int descrWidth = std::max(std::max(siftExtractor->getDescriptorWidth(), opponentExtractor->getDescriptorWidth()),
+        std::max(colorHistExtractor->getDescriptorWidth(), hueSatExtractor->getDescriptorWidth()));
+    int margin = ScaleSpace::tileMargin(firstOctave, nOctaves, nOctaveLayers, sigma, descrWidth);
+    int align = ScaleSpace::tileAlignment(firstOctave, nOctaves);
+    tileSize = (tileSize + align - 1) / align * align;
+
+    vector<ScaleSpace::Pyramid> pyramids = descriptorPyramids(&type, 1);
+    Ptr<OPSIFT> sift = OPSIFT::create();
+    keyPoints.clear();
+    descriptors.release();
+
+    for (int y0 = 0; y0 < img.rows; y0 += tileSize) {
+        for (int x0 = 0; x0 < img.cols; x0 += tileSize) {
+            Rect tile(x0, y0, std::min(tileSize, img.cols - x0), std::min(tileSize, img.rows - y0));
+            int px0 = std::max(x0 - margin, 0) / align * align;
+            int py0 = std::max(y0 - margin, 0) / align * align;
+            Rect padded(px0, py0, std::min(tile.br().x + margin, img.cols) - px0, std::min(tile.br().y + margin, img.rows) - py0);
+
+            ScaleSpace scaleSpace(img(padded), firstOctave, nOctaveLayers, sigma, pyramidDepth, nOctaves);
+            scaleSpace.build(pyramids, true, numThreads);
+            vector<KeyPoint> found, kpts;
+            (*sift)(scaleSpace, noArray(), found, noArray());
+
+            // Keep the keypoints inside the tile; those in the margin belong to a neighbouring tile
+            Rect inner = tile - padded.tl();
+            for (size_t i = 0; i < found.size(); ++i) {
+                const Point2f &pt = found[i].pt;
+                if (pt.x >= inner.x && pt.x < inner.x + inner.width && pt.y >= inner.y && pt.y < inner.y + inner.height) {
+                    kpts.push_back(found[i]);
+                }
+            }
+            if (kpts.empty()) {
+                continue;
             }
-            for (int j = 0; j < descr2.cols; ++j) {
-                mergedRow.push_back(m2.at<float>(j));
+
+            Mat tileDescriptors = computeDescriptors(scaleSpace, kpts, parts[0]);
+            if (parts[1] != NONE) {
+                Mat second = computeDescriptors(scaleSpace, kpts, parts[1]);
+                tileDescriptors = mergeDescriptors(tileDescriptors, second);
+            }
+            descriptors.push_back(tileDescriptors);
+
+            for (size_t i = 0; i < kpts.size(); ++i) {
+                kpts[i].pt += Point2f((float)px0, (float)py0);
+                keyPoints.push_back(kpts[i]);
             }
-            // Create a matrix
-            Mat x(mergedRow);
-            Mat y = x.t();
-            descriptors.push_back(y);
-            mergedRow.clear();
         }
     }
+}
+
+// Merge two descriptor types. There should be an equal number of descriptors in the matrices
+Mat DescriptorUtil::mergeDescriptors(Mat& descr1, Mat& descr2) const
+{
+    // 8-bit descriptors stay 8-bit only if both halves are; otherwise both are merged as floats
+    int type = descr1.type() == descr2.type() ? descr1.type() : CV_32F;
+    Mat descriptors(0, descr1.cols + descr2.cols, type);
+
+    if (descr1.rows == descr2.rows && descr1.rows > 0) {
+        Mat m1, m2;
+        descr1.convertTo(m1, type);
+        descr2.convertTo(m2, type);
+        hconcat(m1, m2, descriptors);
+    }
 
     return descriptors;
 }
 
+#if CV_SSE2
+// One round of the perfect shuffle of 6 registers seen as 96 bytes: byte i moves to 2i mod 95.
+// Five rounds move byte 3p + c to 32c + p, which splits 32 interleaved BGR pixels into planes
+static inline void shuffleRound(__m128i v[6])
+{
+    __m128i t[6];
+    for (int k = 0; k < 3; ++k) {
+        t[2 * k] = _mm_unpacklo_epi8(v[k], v[k + 3]);
+        t[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + 3]);
+    }
+    for (int k = 0; k < 6; ++k)
+        v[k] = t[k];
+}
+
+// Opponent channels of 16 pixels whose B, G and R are zero-extended to 16 bits, 8 per register
+static inline void opponentPixels(__m128i b, __m128i g, __m128i r, __m128i &o1, __m128i &o2, __m128i &o3)
+{
+    __m128i rg = _mm_add_epi16(r, g);
+    o1 = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(r, g), _mm_set1_epi16(255)), 1);
+    o2 = _mm_srli_epi16(_mm_sub_epi16(_mm_add_epi16(rg, _mm_set1_epi16(510)), _mm_add_epi16(b, b)), 2);
+    // (x * 21846) >> 16 == x / 3 for all x <= 765
+    o3 = _mm_mulhi_epu16(_mm_add_epi16(rg, b), _mm_set1_epi16(21846));
+}
+#endif
+
+// Converts a row of BGR pixels to the three opponent channels in one pass with integer arithmetic, which gives the
+// same values as the float formulas: (R - G + 255) / 2, (R + G - 2B + 510) / 4 and (R + G + B) / 3, truncated
+static void opponentRow(const uchar *bgr, uchar *o1, uchar *o2, uchar *o3, int width)
+{
+    int x = 0;
+#if CV_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; x <= width - 32; x += 32) {
+        __m128i v[6];
+        for (int k = 0; k < 6; ++k)
+            v[k] = _mm_loadu_si128((const __m128i*)(bgr + x * 3 + k * 16));
+        for (int round = 0; round < 5; ++round)
+            shuffleRound(v);
+
+        // v[0], v[1] hold B, v[2], v[3] G and v[4], v[5] R of the 32 pixels
+        for (int h = 0; h < 2; ++h) {
+            __m128i lo1, lo2, lo3, hi1, hi2, hi3;
+            opponentPixels(_mm_unpacklo_epi8(v[h], zero), _mm_unpacklo_epi8(v[2 + h], zero),
+                _mm_unpacklo_epi8(v[4 + h], zero), lo1, lo2, lo3);
+            opponentPixels(_mm_unpackhi_epi8(v[h], zero), _mm_unpackhi_epi8(v[2 + h], zero),
+                _mm_unpackhi_epi8(v[4 + h], zero), hi1, hi2, hi3);
+            _mm_storeu_si128((__m128i*)(o1 + x + h * 16), _mm_packus_epi16(lo1, hi1));
+            _mm_storeu_si128((__m128i*)(o2 + x + h * 16), _mm_packus_epi16(lo2, hi2));
+            _mm_storeu_si128((__m128i*)(o3 + x + h * 16), _mm_packus_epi16(lo3, hi3));
+        }
+    }
+#endif
+    for (; x < width; ++x) {
+        int b = bgr[x * 3], g = bgr[x * 3 + 1], r = bgr[x * 3 + 2];
+        o1[x] = (uchar)((r - g + 255) >> 1);
+        o2[x] = (uchar)((r + g - 2 * b + 510) >> 2);
+        o3[x] = (uchar)((r + g + b) / 3);
+    }
+}
+
 // Convert an image from BGR color space to opponent color space
 vector<Mat> DescriptorUtil::convertToOpponentColor(const Mat &bgrImage)
 {
     vector<Mat> opponentChannels;
+    convertToOpponentColor(bgrImage, opponentChannels);
+    return opponentChannels;
+}
+
+// Convert an image from BGR color space to opponent color space, into the caller's channels
+void DescriptorUtil::convertToOpponentColor(const Mat &bgrImage, vector<Mat> &opponentChannels)
+{
     if( bgrImage.type() != CV_8UC3 )
         CV_Error( CV_StsBadArg, "input image must be an BGR image of type CV_8UC3" );
 
-    // Split image into BGR to allow conversion to Opponent Color Space.
-    vector<Mat> bgrChannels(3);
-    split(bgrImage, bgrChannels);
-
-    // Prepare opponent color space storage matrices.
+    // Channels of the right size and type are written in place
     opponentChannels.resize(3);
-    opponentChannels[0] = cv::Mat(bgrImage.size(), CV_8UC1); // R-G RED-GREEN
-    opponentChannels[1] = cv::Mat(bgrImage.size(), CV_8UC1); // R+G-2B YELLOW-BLUE
-    opponentChannels[2] = cv::Mat(bgrImage.size(), CV_8UC1); // R+G+B
+    opponentChannels[0].create(bgrImage.size(), CV_8UC1); // R-G RED-GREEN
+    opponentChannels[1].create(bgrImage.size(), CV_8UC1); // R+G-2B YELLOW-BLUE
+    opponentChannels[2].create(bgrImage.size(), CV_8UC1); // R+G+B
 
-    // Calculate the channels of the opponent color space
-    {
-        // (R - G + 255) / 2
-        MatConstIterator_<unsigned char> rIt = bgrChannels[2].begin<unsigned char>();
-        MatConstIterator_<unsigned char> gIt = bgrChannels[1].begin<unsigned char>();
-        MatConstIterator_<unsigned char> bIt = bgrChannels[0].begin<unsigned char>();
-        MatIterator_<unsigned char> dstIt = opponentChannels[0].begin<unsigned char>();
-        float factor = 1.0f / 2.0f;
-        for( ; dstIt != opponentChannels[0].end<unsigned char>(); ++rIt, ++gIt, ++dstIt ) {
-            int value = static_cast<int>((static_cast<float>(static_cast<int>(*rIt)-static_cast<int>(*gIt)) + 255) * factor);
-            (*dstIt) = static_cast<unsigned char>(value);
-        }
-    }
-    {
-        // (R + G - 2B + 510) / 4
-        MatConstIterator_<unsigned char> rIt = bgrChannels[2].begin<unsigned char>();
-        MatConstIterator_<unsigned char> gIt = bgrChannels[1].begin<unsigned char>();
-        MatConstIterator_<unsigned char> bIt = bgrChannels[0].begin<unsigned char>();
-        MatIterator_<unsigned char> dstIt = opponentChannels[1].begin<unsigned char>();
-        float factor = 1.0f / 4.0f;
-        for( ; dstIt != opponentChannels[1].end<unsigned char>(); ++rIt, ++gIt, ++bIt, ++dstIt ) {
-            int value = static_cast<int>( static_cast<float>((static_cast<int>(*rIt) + static_cast<int>(*gIt) - 2*static_cast<int>(*bIt)) + 510) * factor );
-            (*dstIt) = static_cast<unsigned char>(value);
-        }
+    // The colors could be weighted differently for the third channel, as OpenCV does when it converts from color
+    // to grayscale: 0.299 R + 0.587 G + 0.114 B
+    Size size = bgrImage.size();
+    if (bgrImage.isContinuous() && opponentChannels[0].isContinuous() && opponentChannels[1].isContinuous() &&
+        opponentChannels[2].isContinuous()) {
+        size.width *= size.height;
+        size.height = 1;
     }
-    {
-        // (R + G + B) / 3
-        MatConstIterator_<unsigned char> rIt = bgrChannels[2].begin<unsigned char>();
-        MatConstIterator_<unsigned char> gIt = bgrChannels[1].begin<unsigned char>();
-        MatConstIterator_<unsigned char> bIt = bgrChannels[0].begin<unsigned char>();
-        MatIterator_<unsigned char> dstIt = opponentChannels[2].begin<unsigned char>();
-        float factor = 1.0f / 3.0f;
-        for( ; dstIt != opponentChannels[2].end<unsigned char>(); ++rIt, ++gIt, ++bIt, ++dstIt ) {
-            int value = static_cast<int>((static_cast<float>(static_cast<int>(*rIt) + 
-			  static_cast<int>(*gIt) + static_cast<int>(*bIt))) * factor);
-            // The colors could be weighted differently. Below is how OpenCV weights RGB when it converts from color to grayscale:
-            // int value = static_cast<int>(0.299f * static_cast<float>(*rIt) + 0.587f * static_cast<float>(*gIt) + 0.115f * static_cast<float>(*bIt));
-            (*dstIt) = static_cast<unsigned char>(value);
-        }
+    for (int y = 0; y < size.height; ++y) {
+        opponentRow(bgrImage.ptr<uchar>(y), opponentChannels[0].ptr<uchar>(y), opponentChannels[1].ptr<uchar>(y),
+            opponentChannels[2].ptr<uchar>(y), size.width);
     }
-    return opponentChannels;
 }
 
 // Reads descriptors from a file
@@ -228,47 +444,82 @@ void DescriptorUtil::match(const Mat &descr1, Mat &descr2,
 					  const vector<KeyPoint> &kpts1, const vector<KeyPoint> &kpts2, const Mat &img1, const Mat &img2, 
 					  const Mat &homography, const string outFilename, bool drawMatches)
 {
+    // Image 1 queries image 2, so image 2 is the one indexed
+    MatcherIndex index2(descr2, matcherType);
+
     // matching descriptors
-    FlannBasedMatcher matcher;
     vector<DMatch> matches;
-    matcher.match(descr1, descr2, matches);
+    // Quality of every match, lower is better: its distance, or in ratio-test mode the ratio of its distance to the second nearest
+    vector<float> scores;
+    // Matches that fail the mutual-consistency check are left out of the tiers
+    vector<uchar> kept;
+    if (ratioTest) {
+        vector<DMatch> second;
+        vector<int> reverse;
+        index2.knnMatch(descr1, matches, second, mutualCheck ? &reverse : 0);
+        scores.resize(matches.size());
+        kept.assign(matches.size(), 1);
+        for (size_t i = 0; i < matches.size(); ++i) {
+            // With no second neighbour the match is unambiguous; two zero distances are as ambiguous as can be
+            if (second[i].trainIdx < 0)
+                scores[i] = 0;
+            else
+                scores[i] = second[i].distance > 0 ? matches[i].distance / second[i].distance : 1;
+            if (mutualCheck && reverse[matches[i].trainIdx] != matches[i].queryIdx)
+                kept[i] = 0;
+        }
+    }
+    else {
+        index2.match(descr1, matches);
+        scores.resize(matches.size());
+        kept.assign(matches.size(), 1);
+        for (size_t i = 0; i < matches.size(); ++i) {
+            scores[i] = matches[i].distance;
+        }
+    }
     {
         Point p1 = kpts1[matches[0].queryIdx].pt; // image 1 point
         Point p2 = kpts2[matches[0].trainIdx].pt; // image 2 point
     }
-    int totalMatches = matches.size();
-    sort(matches.begin(), matches.end(), [](const DMatch &m1, const DMatch &m2) {
-        return m1.distance < m2.distance;
+    // Check every match against the homography. Every query keypoint counts towards the bounds, kept or not
+    HomographyEvaluator evaluator(homography, img2.size());
+    vector<uchar> allCorrect;
+    int outBounds = evaluator.evaluate(matches, kpts1, kpts2, allCorrect);
+
+    // Sort the kept matches by quality
+    vector<int> order;
+    for (int i = 0; i < (int)matches.size(); ++i) {
+        if (kept[i]) order.push_back(i);
+    }
+    sort(order.begin(), order.end(), [&scores](int i1, int i2) {
+        return scores[i1] < scores[i2];
     });
-    bool *correct = new bool[totalMatches];
-    memset(correct, 0, totalMatches);
+    int totalMatches = order.size();
+    vector<DMatch> sorted(totalMatches);
+    vector<float> sortedScores(totalMatches);
+    vector<uchar> correct(totalMatches);
+    for (int i = 0; i < totalMatches; ++i) {
+        sorted[i] = matches[order[i]];
+        sortedScores[i] = scores[order[i]];
+        correct[i] = allCorrect[order[i]];
+    }
+    matches.swap(sorted);
+
+    // Distance tiers, or ratio tiers in ratio-test mode. The drawn matches are the correct ones below maskThreshold
+    const int numDistanceTiers = 28;
+    const float DISTANCES[numDistanceTiers] = {10, 15, 20, 25, 30, 40, 50, 60, 75, 100, 125, 
+	    150, 175, 200, 225, 250, 275, 300, 350, 400, 450, 500, 550, 600, 700, 
+	    800, 900, 1000};
+    const int numRatioTiers = 14;
+    const float RATIOS[numRatioTiers] = {0.3f, 0.4f, 0.5f, 0.55f, 0.6f, 0.65f, 0.7f, 0.75f, 0.8f,
+        0.85f, 0.9f, 0.95f, 0.99f, 1.0f};
+    const float *tiers = ratioTest ? RATIOS : DISTANCES;
+    const int numTiers = ratioTest ? numRatioTiers : numDistanceTiers;
+    const float maskThreshold = ratioTest ? 0.8f : 275;
 
-    int outBounds = 0;
     vector<char> matchesMask( totalMatches, 0 );
     for (int i = 0; i < totalMatches; ++i) {
-        Point p1 = kpts1[matches[i].queryIdx].pt; // image 1 point
-        Point p2 = kpts2[matches[i].trainIdx].pt; // image 2 point
-        Mat p1Mat = (Mat_<double>(3, 1) << (double)p1.x, (double)p1.y, 1.0);
-        Mat p2Mat = (Mat_<double>(3, 1) << (double)p2.x, (double)p2.y, 1.0);
-
-        // if (norm(p2 - H * p1 / H.z)) < 2 * p2.size
-        p1Mat = homography * p1Mat;
-        p1Mat /= p1Mat.at<double>(2, 0);
-        double x = p1Mat.at<double>(0, 0);
-        double y = p1Mat.at<double>(1, 0);
-        // Check for out of bounds
-        if (x < 0 || x > img2.cols || y < 0 || y > img2.rows) {
-            outBounds++;
-        } else {
-            Mat res = p2Mat - p1Mat;
-            //cout << p1Mat << endl;
-            //cout << p2Mat << endl;
-            if (norm(res) < kpts2[matches[i].trainIdx].size) {
-                correct[i] = true;
-            }
-            //cout << (correct[i] ? "good" : "bad") << endl;
-            if (matches[i].distance < 275 && correct[i]) matchesMask[i] = 1;
-        }
+        if (sortedScores[i] < maskThreshold && correct[i]) matchesMask[i] = 1;
     }
 
     ofstream outFile(outFilename.c_str());
@@ -276,16 +527,13 @@ void DescriptorUtil::match(const Mat &descr1, Mat &descr2,
     stringstream s;
     s << totalMatches << "\t"  << (kpts1.size() - outBounds) << endl;
 
-    const int numTiers = 28;
-    int DISTANCES[numTiers] = {10, 15, 20, 25, 30, 40, 50, 60, 75, 100, 125, 
-	    150, 175, 200, 225, 250, 275, 300, 350, 400, 450, 500, 550, 600, 700, 
-	    800, 900, 1000};
-
-    // Find precision and recall values at matches above various tiers of quality
+    // Find precision and recall values at matches above various tiers of quality. The last
+    // tier is inclusive so that a ratio of exactly 1.0 still lands in it
     int numCorrect = 0;
     int j = 0;
     for (int i = 0; i < numTiers; ++i) {
-        while (j < totalMatches && matches[j].distance < DISTANCES[i]) {
+        const bool last = i == numTiers - 1;
+        while (j < totalMatches && (sortedScores[j] < tiers[i] || (last && sortedScores[j] == tiers[i]))) {
             if (correct[j]) {
                 ++numCorrect;
             }
@@ -310,6 +558,4 @@ void DescriptorUtil::match(const Mat &descr1, Mat &descr2,
         waitKey(0);
         destroyWindow("Match Results");
     }
-
-    delete [] correct;
 }
@@ -3,6 +3,10 @@ Authors: Nick Huebner, Clark Olson, Siqi Zhang
 DescriptorUtil.h
 
 This class provides utilities for computing key points and different types of descriptors.
+
+The const members may be called from several threads at once. The descriptor extractors they share
+keep no state between calls apart from per-thread scratch buffers and only read their settings, so
+the setters must not be called while any of them runs.
 */
 
 #ifndef SIFTPROGRAM_H
@@ -12,21 +16,72 @@ This class provides utilities for computing key points and different types of de
 #include "ColorHistSIFT.h"
 #include "HueSatSIFT.h"
 #include "OPSIFT.h"
+#include "ScaleSpace.h"
+#include "HomographyEvaluator.h"
+#include "MatcherIndex.h"
 #include <opencv2\features2d.hpp>
 #include <opencv2/opencv.hpp>
 #include "opencv2\xfeatures2d\nonfree.hpp"  //3.0 version
+#include <map>
+#include <mutex>
 using namespace cv;
 
 class DescriptorUtil
 {
 public:
-    // Constructor, initializes parameters to be used for the keypoint detectors and descriptor extractors
-    DescriptorUtil();
+    // Constructor, initializes parameters to be used for the keypoint detectors and descriptor extractors.
+    // descriptorType selects the element type of the SIFT-family descriptors, CV_32F or CV_8U (SURF is always CV_32F)
+    DescriptorUtil(int descriptorType = CV_32F);
     // Destructor
     ~DescriptorUtil();
 
+    // Sets the number of threads each descriptor extractor uses: 1 runs serially, 0 lets OpenCV decide
+    void setNumThreads(int nThreads);
+
+    // Lets the SIFT, opponent SIFT and hue-saturation extractors compute the gradient or hue maps of densely sampled pyramid
+    // levels once per level instead of once per keypoint. Worth it for images with many overlapping keypoints
+    void setDenseMaps(bool enabled);
+
+    // Selects the nearest-neighbour search used by match(). FLANN_MATCHER (the default) is approximate and randomized;
+    // BRUTE_FORCE_MATCHER is exact and gives the same matches on every run
+    void setMatcher(MATCHER_TYPES type);
+
+    // With the ratio test enabled, match() finds the two nearest neighbours of every descriptor and ranks its matches by the ratio
+    // of their distances (Lowe's ratio test) instead of by distance, writing one tier per ratio threshold. With mutual set, only
+    // matches whose second-image descriptor has the first-image descriptor as its own nearest neighbour are kept
+    void setRatioTest(bool enabled, bool mutual = false);
+
+    // Stores the pyramids of every image from now on as 16-bit fixed point instead of float, which halves their memory.
+    // Descriptors and keypoints differ slightly from the float pyramids' because the blurred values are quantized
+    void setFixedPointPyramids(bool enabled);
+
+    // Keeps the scale space of an image cached for as long as the lease lives, so that detection and every descriptor type
+    // computed for the image in the meantime share its pyramids. Without a lease, every call builds the pyramids it needs and
+    // drops them when it returns. An image is identified by its pixel pointer, size and step, and must not be modified while
+    // it is leased. Different images may be leased and processed concurrently; one image must be used by one thread at a time
+    class ScaleSpaceLease
+    {
+    public:
+        ScaleSpaceLease(const DescriptorUtil &util, const Mat &img);
+        ~ScaleSpaceLease();
+
+    private:
+        ScaleSpaceLease(const ScaleSpaceLease&);
+        ScaleSpaceLease& operator=(const ScaleSpaceLease&);
+
+        const DescriptorUtil &util;
+        Mat img;
+    };
+
+    // Returns the scale space of a leased image, or else a new one that is not cached
+    Ptr<ScaleSpace> getScaleSpace(const Mat& img) const;
+
     // Detect features in an image using the SIFT feature detector. The keyPoints parameter will contain the key points detected
-    void detectFeatures(const Mat& img, vector<KeyPoint> &keyPoints);
+    void detectFeatures(const Mat& img, vector<KeyPoint> &keyPoints) const;
+
+    // As above, but first builds the detection pyramids together with the pyramids the given descriptor types will be computed
+    // from, all as one parallel task graph. Only useful while the image is leased, so that the descriptors find those pyramids
+    void detectFeatures(const Mat& img, vector<KeyPoint> &keyPoints, const DescriptorType *types, int numTypes) const;
 
     // Reads key points from a file
     vector<KeyPoint> readKeyPoints(string filePath, string imgName);
@@ -35,14 +90,27 @@ public:
     void writeKeyPoints(vector<KeyPoint> *kpts, string *imgNames, int numImgs, string filename);
 
     // Computes the descriptors of a specified type for an image, given a set of keypoints
-    Mat computeDescriptors(Mat& img, vector<KeyPoint> &kpts, DESC_TYPES type);
+    Mat computeDescriptors(Mat& img, vector<KeyPoint> &kpts, DESC_TYPES type) const;
 
-    // Merge two descriptor types. There should be an equal number of descriptors in the matrices
-    Mat mergeDescriptors(Mat& descr1, Mat& descr2);
+    // Detects keypoints and computes their descriptors tile by tile, for images too large for their pyramids to fit in memory.
+    // Every tileSize x tileSize tile is built into pyramids together with a margin that holds the support of its keypoints, and
+    // keeps only the keypoints inside the tile, so that keypoints on the seams are found once. Keypoints of the first nOctaves
+    // octaves and their descriptors are the same as for the whole image (coarser octaves are not searched), keypoints are
+    // ordered tile by tile, and at most one tile's pyramids are held at a time. SURF descriptors are not supported
+    void detectAndComputeTiled(const Mat& img, const DescriptorType& type, vector<KeyPoint> &keyPoints, Mat& descriptors,
+        int tileSize = 2048, int nOctaves = 5);
+
+    // Merge two descriptor types. There should be an equal number of descriptors in the matrices.
+    // The result is CV_8U when both inputs are, CV_32F otherwise
+    Mat mergeDescriptors(Mat& descr1, Mat& descr2) const;
 
     // Convert an image from BGR color space to opponent color space
     vector<Mat> convertToOpponentColor(const Mat &bgrImage);
 
+    // Same as above, into opponentChannels. Channels that already have the image's size and type CV_8UC1 are
+    // filled in place, so a batch of frames can reuse the same buffers (or Mats wrapping the caller's memory)
+    void convertToOpponentColor(const Mat &bgrImage, vector<Mat> &opponentChannels);
+
     // Reads descriptors from a file
     Mat readDescriptors(string filePath, string imgName);
 
@@ -52,6 +120,60 @@ public:
     // Matches descriptors from two different images, evaluates the matches using the provided homography, and writes the results out to a file
     void match(const Mat &descr1, Mat &descr2, const vector<KeyPoint> &kpts1, const vector<KeyPoint> &kpts2, const Mat &img1, const Mat &img2, const Mat &homography, const string outFilename, bool drawMatches = false);
 
+private:
+    // Identifies an image in the scale space cache
+    struct ImageKey
+    {
+        const uchar *data;
+        int rows, cols, type;
+        size_t step;
+
+        explicit ImageKey(const Mat &img) : data(img.data), rows(img.rows), cols(img.cols), type(img.type()), step(img.step) { }
+        bool operator<(const ImageKey &other) const
+        {
+            if (data != other.data) return data < other.data;
+            if (rows != other.rows) return rows < other.rows;
+            if (cols != other.cols) return cols < other.cols;
+            if (type != other.type) return type < other.type;
+            return step < other.step;
+        }
+    };
+
+    // A cached scale space and the number of leases holding it
+    struct LeasedScaleSpace
+    {
+        Ptr<ScaleSpace> scaleSpace;
+        int leases;
+    };
+
+    // Detects features on a scale space
+    void detectFeatures(ScaleSpace& scaleSpace, vector<KeyPoint> &keyPoints) const;
+
+    // Computes SIFT-family descriptors of a specified type from a scale space
+    Mat computeDescriptors(ScaleSpace& scaleSpace, vector<KeyPoint> &kpts, DESC_TYPES type) const;
+
+    // Number of threads used for descriptor extraction
+    int numThreads;
+
+    // Nearest-neighbour search used by match()
+    MATCHER_TYPES matcherType;
+    // Ratio-test mode of match(), and whether it applies the mutual-consistency check
+    bool ratioTest;
+    bool mutualCheck;
+    // Element depth of the pyramids, CV_32F or CV_16S
+    int pyramidDepth;
+
+    // Descriptor extractors, kept so that their scratch buffers are reused across images. They are shared by all threads
+    // calling the const members, which only call their const operator()
+    Ptr<OPSIFT> siftExtractor;
+    Ptr<OPSIFT> opponentExtractor;
+    Ptr<ColorHistSIFT> colorHistExtractor;
+    Ptr<HueSatSIFT> hueSatExtractor;
+
+    // Scale spaces of the currently leased images
+    mutable map<ImageKey, LeasedScaleSpace> scaleSpaces;
+    // Guards scaleSpaces, so that different images can be processed on different threads
+    mutable mutex scaleSpaceLock;
 };
 
 #endif
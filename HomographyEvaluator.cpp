@@ -0,0 +1,62 @@
+/*
+HomographyEvaluator.cpp
+
+Checks descriptor matches against a ground-truth homography.
+*/
+
+#include "HomographyEvaluator.h"
+
+HomographyEvaluator::HomographyEvaluator(const Mat &homography, Size imageSize)
+    : size(imageSize)
+{
+    CV_Assert(homography.rows == 3 && homography.cols == 3);
+    Mat h;
+    homography.convertTo(h, CV_64F);
+    H = h;
+}
+
+// Evaluates matches from kpts1 (query) to kpts2 (train)
+int HomographyEvaluator::evaluate(const vector<DMatch> &matches, const vector<KeyPoint> &kpts1, const vector<KeyPoint> &kpts2,
+                                  vector<uchar> &correct)
+{
+    int n = (int)matches.size();
+    correct.assign(n, 0);
+    xs.resize(n);
+    ys.resize(n);
+
+    // Gather the query points. They are evaluated at whole pixels, as they always have been
+    for (int i = 0; i < n; ++i) {
+        Point p1 = kpts1[matches[i].queryIdx].pt;
+        xs[i] = p1.x;
+        ys[i] = p1.y;
+    }
+
+    // Project them all through the homography
+    const double h00 = H(0, 0), h01 = H(0, 1), h02 = H(0, 2);
+    const double h10 = H(1, 0), h11 = H(1, 1), h12 = H(1, 2);
+    const double h20 = H(2, 0), h21 = H(2, 1), h22 = H(2, 2);
+    double *x = xs.empty() ? 0 : &xs[0];
+    double *y = ys.empty() ? 0 : &ys[0];
+    for (int i = 0; i < n; ++i) {
+        double w = 1.0 / (h20 * x[i] + h21 * y[i] + h22);
+        double px = (h00 * x[i] + h01 * y[i] + h02) * w;
+        double py = (h10 * x[i] + h11 * y[i] + h12) * w;
+        x[i] = px;
+        y[i] = py;
+    }
+
+    // A match is correct if the projection lands within the matched keypoint's size of it
+    int outOfBounds = 0;
+    for (int i = 0; i < n; ++i) {
+        if (x[i] < 0 || x[i] > size.width || y[i] < 0 || y[i] > size.height) {
+            outOfBounds++;
+            continue;
+        }
+        const KeyPoint &kpt2 = kpts2[matches[i].trainIdx];
+        Point p2 = kpt2.pt;
+        double dx = p2.x - x[i], dy = p2.y - y[i];
+        correct[i] = std::sqrt(dx * dx + dy * dy) < kpt2.size;
+    }
+
+    return outOfBounds;
+}
@@ -0,0 +1,37 @@
+/*
+HomographyEvaluator.h
+
+Checks descriptor matches against a ground-truth homography. A match is correct when the
+query keypoint, projected into the second image, lands within the matched keypoint's size of
+it; matches whose projection falls outside the second image are counted as out of bounds.
+All the query points are projected in one pass over flat arrays, and the arrays are kept
+between calls, so evaluating a set of matches does not allocate per match.
+*/
+
+#ifndef HOMOGRAPHY_EVALUATOR_H
+#define HOMOGRAPHY_EVALUATOR_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+using namespace std;
+using namespace cv;
+
+class HomographyEvaluator
+{
+public:
+    // homography maps points of the first image into the second, whose size is imageSize
+    HomographyEvaluator(const Mat &homography, Size imageSize);
+
+    // Evaluates matches from kpts1 (query) to kpts2 (train). correct receives 1 for every correct match and 0 otherwise.
+    // Returns the number of matches whose query point projects outside the second image
+    int evaluate(const vector<DMatch> &matches, const vector<KeyPoint> &kpts1, const vector<KeyPoint> &kpts2,
+                 vector<uchar> &correct);
+
+private:
+    Matx33d H;
+    Size size;
+    // Projected query points, reused across calls
+    vector<double> xs, ys;
+};
+
+#endif
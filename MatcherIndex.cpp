@@ -0,0 +1,109 @@
+/*
+MatcherIndex.cpp
+
+The descriptors of one image, indexed for nearest-neighbour search.
+*/
+
+#include "MatcherIndex.h"
+#include <cfloat>
+
+// Same forest and search effort as FlannBasedMatcher's defaults
+static const int FLANN_TREES = 4;
+static const int FLANN_CHECKS = 32;
+
+MatcherIndex::MatcherIndex(const Mat &descriptors, MATCHER_TYPES type)
+    : matcherType(type), numDescriptors(descriptors.rows)
+{
+    CV_Assert(descriptors.empty() || descriptors.type() == CV_32F || descriptors.type() == CV_8U);
+    if (matcherType == BRUTE_FORCE_MATCHER) {
+        bruteForce.train(descriptors);
+    }
+    else if (!descriptors.empty()) {
+        // FLANN's KD-tree only indexes float data, so 8-bit descriptors are widened first
+        if (descriptors.type() == CV_32F) {
+            flannDescr = descriptors;
+        }
+        else {
+            descriptors.convertTo(flannDescr, CV_32F);
+        }
+        flannIndex = makePtr<flann::Index>(flannDescr, flann::KDTreeIndexParams(FLANN_TREES));
+    }
+}
+
+// Finds the nearest reference descriptor of every query row
+void MatcherIndex::match(const Mat &query, vector<DMatch> &matches) const
+{
+    if (matcherType == BRUTE_FORCE_MATCHER) {
+        bruteForce.match(query, matches);
+        return;
+    }
+
+    matches.clear();
+    if (query.empty() || !flannIndex) {
+        return;
+    }
+    CV_Assert(query.cols == flannDescr.cols);
+    Mat q = query;
+    if (q.type() != CV_32F) {
+        query.convertTo(q, CV_32F);
+    }
+
+    // Searching only reads the forest, so concurrent queries need no lock
+    Mat indices(q.rows, 1, CV_32S), dists(q.rows, 1, CV_32F);
+    flannIndex->knnSearch(q, indices, dists, 1, flann::SearchParams(FLANN_CHECKS));
+
+    matches.resize(q.rows);
+    for (int i = 0; i < q.rows; ++i) {
+        // FLANN reports squared distances
+        matches[i] = DMatch(i, indices.at<int>(i), 0, std::sqrt(dists.at<float>(i)));
+    }
+}
+
+// Finds the two nearest reference descriptors of every query row, and optionally the nearest query row of every reference descriptor
+void MatcherIndex::knnMatch(const Mat &query, vector<DMatch> &nearest, vector<DMatch> &second, vector<int> *reverse) const
+{
+    if (matcherType == BRUTE_FORCE_MATCHER) {
+        bruteForce.knnMatch(query, nearest, second, reverse);
+        return;
+    }
+
+    nearest.clear();
+    second.clear();
+    if (reverse) {
+        reverse->assign(numDescriptors, -1);
+    }
+    if (query.empty() || !flannIndex) {
+        return;
+    }
+    CV_Assert(query.cols == flannDescr.cols);
+    Mat q = query;
+    if (q.type() != CV_32F) {
+        query.convertTo(q, CV_32F);
+    }
+
+    // FLANN fills missing neighbours with index -1
+    int k = std::min(2, numDescriptors);
+    Mat indices(q.rows, k, CV_32S), dists(q.rows, k, CV_32F);
+    flannIndex->knnSearch(q, indices, dists, k, flann::SearchParams(FLANN_CHECKS));
+
+    nearest.resize(q.rows);
+    second.resize(q.rows);
+    for (int i = 0; i < q.rows; ++i) {
+        nearest[i] = DMatch(i, indices.at<int>(i, 0), 0, std::sqrt(dists.at<float>(i, 0)));
+        if (k > 1 && indices.at<int>(i, 1) >= 0) {
+            second[i] = DMatch(i, indices.at<int>(i, 1), 0, std::sqrt(dists.at<float>(i, 1)));
+        }
+        else {
+            second[i] = DMatch(i, -1, 0, FLT_MAX);
+        }
+    }
+
+    if (reverse) {
+        flann::Index queryIndex(q, flann::KDTreeIndexParams(FLANN_TREES));
+        Mat revIndices(numDescriptors, 1, CV_32S), revDists(numDescriptors, 1, CV_32F);
+        queryIndex.knnSearch(flannDescr, revIndices, revDists, 1, flann::SearchParams(FLANN_CHECKS));
+        for (int j = 0; j < numDescriptors; ++j) {
+            (*reverse)[j] = revIndices.at<int>(j);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+MatcherIndex.h
+
+The descriptors of one image, indexed for nearest-neighbour search with either a FLANN
+KD-tree forest or the exact brute-force matcher, so that DescriptorUtil::match() can query
+both the same way. The index is read-only once built: queries from several threads may run
+on it at the same time.
+*/
+
+#ifndef MATCHER_INDEX_H
+#define MATCHER_INDEX_H
+
+#include "BruteForceMatcher.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+using namespace std;
+using namespace cv;
+
+// Nearest-neighbour search used for matching
+enum MATCHER_TYPES { FLANN_MATCHER, BRUTE_FORCE_MATCHER };
+
+class MatcherIndex
+{
+public:
+    // Indexes the reference descriptors, one per row, CV_32F or CV_8U. The matrix is referenced, not copied,
+    // and must outlive the index
+    MatcherIndex(const Mat &descriptors, MATCHER_TYPES type);
+
+    // Finds the nearest reference descriptor of every query row. matches[i] belongs to query row i, its trainIdx is
+    // the reference row and its distance the Euclidean distance. Safe to call from several threads at once
+    void match(const Mat &query, vector<DMatch> &matches) const;
+
+    // Finds the two nearest reference descriptors of every query row, for the ratio test; second[i] has trainIdx -1 and
+    // distance FLT_MAX when there is no second one. If reverse is given, it receives the nearest query row of every reference
+    // descriptor, for a mutual-consistency check. The brute-force matcher finds all three in one pass; FLANN needs a second
+    // search, from the reference into a temporary index of the query. Safe to call from several threads at once
+    void knnMatch(const Mat &query, vector<DMatch> &nearest, vector<DMatch> &second, vector<int> *reverse = 0) const;
+
+    MATCHER_TYPES type() const { return matcherType; }
+    // Number of reference descriptors
+    int size() const { return numDescriptors; }
+
+private:
+    MATCHER_TYPES matcherType;
+    int numDescriptors;
+
+    // FLANN_MATCHER: the KD-tree forest and the float copy of the descriptors it indexes
+    Mat flannDescr;
+    Ptr<flann::Index> flannIndex;
+    // BRUTE_FORCE_MATCHER
+    BruteForceMatcher bruteForce;
+
+    MatcherIndex(const MatcherIndex &);
+    MatcherIndex &operator=(const MatcherIndex &);
+};
+
+#endif
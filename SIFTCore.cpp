@@ -0,0 +1,441 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+/*
+SIFTCore.cpp
+
+The SIFT engine shared by OPSIFT, ColorHistSIFT, HueSatSIFT and NEWSIFT.
+*/
+
+#include "SIFTCore.h"
+
+namespace cv
+{
+	// Computes a gradient orientation histogram at a specified pixel
+	template <typename T>
+	static float calcOrientationHist(const Mat& img, Point pt, int radius,
+		float sigma, float* hist, int n)
+	{
+		int i, j, k, len = (radius * 2 + 1)*(radius * 2 + 1);
+
+		float expf_scale = -1.f / (2.f * sigma * sigma);
+		AutoBuffer<float> buf(len * 4 + n + 4);
+		float *X = buf, *Y = X + len, *Mag = X, *Ori = Y + len, *W = Ori + len;
+		float* temphist = W + len + 2;
+
+		for (i = 0; i < n; i++)
+			temphist[i] = 0.f;
+
+		for (i = -radius, k = 0; i <= radius; i++)
+		{
+			int y = pt.y + i;
+			if (y <= 0 || y >= img.rows - 1)
+				continue;
+			for (j = -radius; j <= radius; j++)
+			{
+				int x = pt.x + j;
+				if (x <= 0 || x >= img.cols - 1)
+					continue;
+
+				float dx = (float)(img.at<T>(y, x + 1) - img.at<T>(y, x - 1));
+				float dy = (float)(img.at<T>(y - 1, x) - img.at<T>(y + 1, x));
+
+				X[k] = dx; Y[k] = dy; W[k] = (i*i + j*j)*expf_scale;
+				k++;
+			}
+		}
+
+		len = k;
+
+		// compute gradient values, orientations and the weights over the pixel neighborhood
+		hal::exp(W, W, len);
+		hal::fastAtan2(Y, X, Ori, len, true);
+		hal::magnitude(X, Y, Mag, len);
+
+		for (k = 0; k < len; k++)
+		{
+			int bin = cvRound((n / 360.f)*Ori[k]);
+			if (bin >= n)
+				bin -= n;
+			if (bin < 0)
+				bin += n;
+			temphist[bin] += W[k] * Mag[k];
+		}
+
+		// smooth the histogram
+		temphist[-1] = temphist[n - 1];
+		temphist[-2] = temphist[n - 2];
+		temphist[n] = temphist[0];
+		temphist[n + 1] = temphist[1];
+		for (i = 0; i < n; i++)
+		{
+			hist[i] = (temphist[i - 2] + temphist[i + 2])*(1.f / 16.f) +
+				(temphist[i - 1] + temphist[i + 1])*(4.f / 16.f) +
+				temphist[i] * (6.f / 16.f);
+		}
+
+		float maxval = hist[0];
+		for (i = 1; i < n; i++)
+			maxval = std::max(maxval, hist[i]);
+
+		return maxval;
+	}
+
+
+	//
+	// Interpolates a scale-space extremum's location and scale to subpixel
+	// accuracy to form an image feature. Rejects features with low contrast.
+	// Based on Section 4 of Lowe's paper.
+	template <typename T>
+	static bool adjustLocalExtrema(const vector<Mat>& dog_pyr, KeyPoint& kpt, int octv,
+		int& layer, int& r, int& c, int nOctaveLayers,
+		float contrastThreshold, float edgeThreshold, float sigma)
+	{
+		const float img_scale = 1.f / (255 * PyramidScale<T>::INTENSITY);
+		const float deriv_scale = img_scale*0.5f;
+		const float second_deriv_scale = img_scale;
+		const float cross_deriv_scale = img_scale*0.25f;
+
+		float xi = 0, xr = 0, xc = 0, contr = 0;
+		int i = 0;
+
+		for (; i < NEWSIFT_MAX_INTERP_STEPS; i++)
+		{
+			int idx = octv*(nOctaveLayers + 2) + layer;
+			const Mat& img = dog_pyr[idx];
+			const Mat& prev = dog_pyr[idx - 1];
+			const Mat& next = dog_pyr[idx + 1];
+
+			Vec3f dD((img.at<T>(r, c + 1) - img.at<T>(r, c - 1))*deriv_scale,
+				(img.at<T>(r + 1, c) - img.at<T>(r - 1, c))*deriv_scale,
+				(next.at<T>(r, c) - prev.at<T>(r, c))*deriv_scale);
+
+			float v2 = (float)img.at<T>(r, c) * 2;
+			float dxx = (img.at<T>(r, c + 1) + img.at<T>(r, c - 1) - v2)*second_deriv_scale;
+			float dyy = (img.at<T>(r + 1, c) + img.at<T>(r - 1, c) - v2)*second_deriv_scale;
+			float dss = (next.at<T>(r, c) + prev.at<T>(r, c) - v2)*second_deriv_scale;
+			float dxy = (img.at<T>(r + 1, c + 1) - img.at<T>(r + 1, c - 1) -
+				img.at<T>(r - 1, c + 1) + img.at<T>(r - 1, c - 1))*cross_deriv_scale;
+			float dxs = (next.at<T>(r, c + 1) - next.at<T>(r, c - 1) -
+				prev.at<T>(r, c + 1) + prev.at<T>(r, c - 1))*cross_deriv_scale;
+			float dys = (next.at<T>(r + 1, c) - next.at<T>(r - 1, c) -
+				prev.at<T>(r + 1, c) + prev.at<T>(r - 1, c))*cross_deriv_scale;
+
+			Matx33f H(dxx, dxy, dxs,
+				dxy, dyy, dys,
+				dxs, dys, dss);
+
+			Vec3f X = H.solve(dD, DECOMP_LU);
+
+			xi = -X[2];
+			xr = -X[1];
+			xc = -X[0];
+
+			if (std::abs(xi) < 0.5f && std::abs(xr) < 0.5f && std::abs(xc) < 0.5f)
+				break;
+
+			if (std::abs(xi) > (float)(INT_MAX / 3) ||
+				std::abs(xr) > (float)(INT_MAX / 3) ||
+				std::abs(xc) > (float)(INT_MAX / 3))
+				return false;
+
+			c += cvRound(xc);
+			r += cvRound(xr);
+			layer += cvRound(xi);
+
+			if (layer < 1 || layer > nOctaveLayers ||
+				c < NEWSIFT_IMG_BORDER || c >= img.cols - NEWSIFT_IMG_BORDER ||
+				r < NEWSIFT_IMG_BORDER || r >= img.rows - NEWSIFT_IMG_BORDER)
+				return false;
+		}
+
+		// ensure convergence of interpolation
+		if (i >= NEWSIFT_MAX_INTERP_STEPS)
+			return false;
+
+		{
+			int idx = octv*(nOctaveLayers + 2) + layer;
+			const Mat& img = dog_pyr[idx];
+			const Mat& prev = dog_pyr[idx - 1];
+			const Mat& next = dog_pyr[idx + 1];
+			Matx31f dD((img.at<T>(r, c + 1) - img.at<T>(r, c - 1))*deriv_scale,
+				(img.at<T>(r + 1, c) - img.at<T>(r - 1, c))*deriv_scale,
+				(next.at<T>(r, c) - prev.at<T>(r, c))*deriv_scale);
+			float t = dD.dot(Matx31f(xc, xr, xi));
+
+			contr = img.at<T>(r, c)*img_scale + t * 0.5f;
+			if (std::abs(contr) * nOctaveLayers < contrastThreshold)
+				return false;
+
+			// principal curvatures are computed using the trace and det of Hessian
+			float v2 = img.at<T>(r, c)*2.f;
+			float dxx = (img.at<T>(r, c + 1) + img.at<T>(r, c - 1) - v2)*second_deriv_scale;
+			float dyy = (img.at<T>(r + 1, c) + img.at<T>(r - 1, c) - v2)*second_deriv_scale;
+			float dxy = (img.at<T>(r + 1, c + 1) - img.at<T>(r + 1, c - 1) -
+				img.at<T>(r - 1, c + 1) + img.at<T>(r - 1, c - 1)) * cross_deriv_scale;
+			float tr = dxx + dyy;
+			float det = dxx * dyy - dxy * dxy;
+
+			if (det <= 0 || tr*tr*edgeThreshold >= (edgeThreshold + 1)*(edgeThreshold + 1)*det)
+				return false;
+		}
+
+		kpt.pt.x = (c + xc) * (1 << octv);
+		kpt.pt.y = (r + xr) * (1 << octv);
+		kpt.octave = octv + (layer << 8) + (cvRound((xi + 0.5) * 255) << 16);
+		kpt.size = sigma*powf(2.f, (layer + xi) / nOctaveLayers)*(1 << octv) * 2;
+		kpt.response = std::abs(contr);
+
+		return true;
+	}
+
+
+	//
+	// Detects features at extrema in DoG scale space.  Bad features are discarded
+	// based on contrast and ratio of principal curvatures.
+	template <typename T>
+	static void findExtrema(const vector<Mat>& gauss_pyr, const vector<Mat>& dog_pyr,
+		vector<KeyPoint>& keypoints, int nOctaveLayers, double contrastThreshold,
+		double edgeThreshold, double sigma)
+	{
+		int nOctaves = (int)gauss_pyr.size() / (nOctaveLayers + 3);
+		int threshold = cvFloor(0.5 * contrastThreshold / nOctaveLayers * 255 * PyramidScale<T>::INTENSITY);
+		const int n = NEWSIFT_ORI_HIST_BINS;
+		float hist[n];
+		KeyPoint kpt;
+
+		keypoints.clear();
+
+		for (int o = 0; o < nOctaves; o++)
+			for (int i = 1; i <= nOctaveLayers; i++)
+			{
+			int idx = o*(nOctaveLayers + 2) + i;
+			const Mat& img = dog_pyr[idx];
+			const Mat& prev = dog_pyr[idx - 1];
+			const Mat& next = dog_pyr[idx + 1];
+			int step = (int)img.step1();
+			int rows = img.rows, cols = img.cols;
+
+			for (int r = NEWSIFT_IMG_BORDER; r < rows - NEWSIFT_IMG_BORDER; r++)
+			{
+				const T* currptr = img.ptr<T>(r);
+				const T* prevptr = prev.ptr<T>(r);
+				const T* nextptr = next.ptr<T>(r);
+
+				for (int c = NEWSIFT_IMG_BORDER; c < cols - NEWSIFT_IMG_BORDER; c++)
+				{
+					T val = currptr[c];
+
+					// find local extrema with pixel accuracy
+					if (std::abs(val) > threshold &&
+						((val > 0 && val >= currptr[c - 1] && val >= currptr[c + 1] &&
+						val >= currptr[c - step - 1] && val >= currptr[c - step] && val >= currptr[c - step + 1] &&
+						val >= currptr[c + step - 1] && val >= currptr[c + step] && val >= currptr[c + step + 1] &&
+						val >= nextptr[c] && val >= nextptr[c - 1] && val >= nextptr[c + 1] &&
+						val >= nextptr[c - step - 1] && val >= nextptr[c - step] && val >= nextptr[c - step + 1] &&
+						val >= nextptr[c + step - 1] && val >= nextptr[c + step] && val >= nextptr[c + step + 1] &&
+						val >= prevptr[c] && val >= prevptr[c - 1] && val >= prevptr[c + 1] &&
+						val >= prevptr[c - step - 1] && val >= prevptr[c - step] && val >= prevptr[c - step + 1] &&
+						val >= prevptr[c + step - 1] && val >= prevptr[c + step] && val >= prevptr[c + step + 1]) ||
+						(val < 0 && val <= currptr[c - 1] && val <= currptr[c + 1] &&
+						val <= currptr[c - step - 1] && val <= currptr[c - step] && val <= currptr[c - step + 1] &&
+						val <= currptr[c + step - 1] && val <= currptr[c + step] && val <= currptr[c + step + 1] &&
+						val <= nextptr[c] && val <= nextptr[c - 1] && val <= nextptr[c + 1] &&
+						val <= nextptr[c - step - 1] && val <= nextptr[c - step] && val <= nextptr[c - step + 1] &&
+						val <= nextptr[c + step - 1] && val <= nextptr[c + step] && val <= nextptr[c + step + 1] &&
+						val <= prevptr[c] && val <= prevptr[c - 1] && val <= prevptr[c + 1] &&
+						val <= prevptr[c - step - 1] && val <= prevptr[c - step] && val <= prevptr[c - step + 1] &&
+						val <= prevptr[c + step - 1] && val <= prevptr[c + step] && val <= prevptr[c + step + 1])))
+					{
+						int r1 = r, c1 = c, layer = i;
+						if (!adjustLocalExtrema<T>(dog_pyr, kpt, o, layer, r1, c1,
+							nOctaveLayers, (float)contrastThreshold,
+							(float)edgeThreshold, (float)sigma))
+							continue;
+						float scl_octv = kpt.size*0.5f / (1 << o);
+						float omax = calcOrientationHist<T>(gauss_pyr[o*(nOctaveLayers + 3) + layer],
+							Point(c1, r1),
+							cvRound(NEWSIFT_ORI_RADIUS * scl_octv),
+							NEWSIFT_ORI_SIG_FCTR * scl_octv,
+							hist, n);
+						float mag_thr = (float)(omax * NEWSIFT_ORI_PEAK_RATIO);
+						for (int j = 0; j < n; j++)
+						{
+							int l = j > 0 ? j - 1 : n - 1;
+							int r2 = j < n - 1 ? j + 1 : 0;
+
+							if (hist[j] > hist[l] && hist[j] > hist[r2] && hist[j] >= mag_thr)
+							{
+								float bin = j + 0.5f * (hist[l] - hist[r2]) / (hist[l] - 2 * hist[j] + hist[r2]);
+								bin = bin < 0 ? n + bin : bin >= n ? bin - n : bin;
+								kpt.angle = 360.f - (float)((360.f / n) * bin);
+								if (std::abs(kpt.angle - 360.f) < FLT_EPSILON)
+									kpt.angle = 0.f;
+								keypoints.push_back(kpt);
+							}
+						}
+					}
+				}
+			}
+			}
+	}
+
+
+	void findSIFTScaleSpaceExtrema(const vector<Mat>& gauss_pyr, const vector<Mat>& dog_pyr,
+		vector<KeyPoint>& keypoints, int nOctaveLayers, double contrastThreshold,
+		double edgeThreshold, double sigma)
+	{
+		if (!dog_pyr.empty() && dog_pyr[0].depth() == CV_16S)
+			findExtrema<short>(gauss_pyr, dog_pyr, keypoints, nOctaveLayers, contrastThreshold, edgeThreshold, sigma);
+		else
+			findExtrema<float>(gauss_pyr, dog_pyr, keypoints, nOctaveLayers, contrastThreshold, edgeThreshold, sigma);
+	}
+
+
+	int siftFirstOctave(const vector<KeyPoint>& keypoints, bool useProvidedKeypoints, int nOctaveLayers)
+	{
+		if (!useProvidedKeypoints)
+			return -1;
+
+		int firstOctave = 0, actualNLayers = 0;
+		for (size_t i = 0; i < keypoints.size(); i++)
+		{
+			int octave, layer;
+			float scale;
+			unpackOctave(keypoints[i], octave, layer, scale);
+			firstOctave = std::min(firstOctave, octave);
+			actualNLayers = std::max(actualNLayers, layer - 2);
+		}
+
+		firstOctave = std::min(firstOctave, 0);
+		CV_Assert(firstOctave >= -1 && actualNLayers <= nOctaveLayers);
+		return firstOctave;
+	}
+
+	void detectSIFTKeypoints(ScaleSpace& scaleSpace, const Mat& mask, vector<KeyPoint>& keypoints,
+		const SIFTParams& params)
+	{
+		int firstOctave = scaleSpace.firstOctave();
+
+		//double t, tf = getTickFrequency();
+		//t = (double)getTickCount();
+		findSIFTScaleSpaceExtrema(scaleSpace.gaussianPyramid(ScaleSpace::GRAY), scaleSpace.dogPyramid(), keypoints,
+			params.nOctaveLayers, params.contrastThreshold, params.edgeThreshold, params.sigma);
+		KeyPointsFilter::removeDuplicated(keypoints);
+
+		if (params.nfeatures > 0)
+			KeyPointsFilter::retainBest(keypoints, params.nfeatures);
+		//t = (double)getTickCount() - t;
+		//printf("keypoint detection time: %g\n", t*1000./tf);
+
+		if (firstOctave < 0)
+			for (size_t i = 0; i < keypoints.size(); i++)
+			{
+			KeyPoint& kpt = keypoints[i];
+			float scale = 1.f / (float)(1 << -firstOctave);
+			kpt.octave = (kpt.octave & ~255) | ((kpt.octave + firstOctave) & 255);
+			kpt.pt *= scale;
+			kpt.size *= scale;
+			}
+
+		if (!mask.empty())
+			KeyPointsFilter::runByPixelsMask(keypoints, mask);
+	}
+
+	void finalizeSIFTDescriptor(float* hist, int d, int n, float* dst, uchar* dst8)
+	{
+		int i, j, k, len;
+
+		// finalize histogram, since the orientation histograms are circular
+		for (i = 0; i < d; i++)
+			for (j = 0; j < d; j++)
+			{
+			int idx = ((i + 1)*(d + 2) + (j + 1))*(n + 2);
+			hist[idx] += hist[idx + n];
+			hist[idx + 1] += hist[idx + n + 1];
+			for (k = 0; k < n; k++)
+				dst[(i*d + j)*n + k] = hist[idx + k];
+			}
+		// copy histogram to the descriptor,
+		// apply hysteresis thresholding
+		// and scale the result, so that it can be easily converted
+		// to byte array
+		float nrm2 = 0;
+		len = d*d*n;
+		for (k = 0; k < len; k++)
+			nrm2 += dst[k] * dst[k];
+		float thr = std::sqrt(nrm2)*NEWSIFT_DESCR_MAG_THR;
+		for (i = 0, nrm2 = 0; i < k; i++)
+		{
+			float val = std::min(dst[i], thr);
+			dst[i] = val;
+			nrm2 += val*val;
+		}
+		nrm2 = NEWSIFT_INT_DESCR_FCTR / std::max(std::sqrt(nrm2), FLT_EPSILON);
+
+#if 1
+		// dst is the float work row; 8-bit descriptors are stored straight into dst8
+		if (dst8)
+			for (k = 0; k < len; k++)
+			{
+				dst8[k] = saturate_cast<uchar>(dst[k] * nrm2);
+			}
+		else
+			for (k = 0; k < len; k++)
+			{
+				dst[k] = saturate_cast<uchar>(dst[k] * nrm2);
+			}
+#else
+		float nrm1 = 0;
+		for (k = 0; k < len; k++)
+		{
+			dst[k] *= nrm2;
+			nrm1 += dst[k];
+		}
+		nrm1 = 1.f / std::max(nrm1, FLT_EPSILON);
+		for (k = 0; k < len; k++)
+		{
+			dst[k] = std::sqrt(dst[k] * nrm1);//saturate_cast<uchar>(std::sqrt(dst[k] * nrm1)*NEWSIFT_INT_DESCR_FCTR);
+		}
+#endif
+	}
+}
@@ -0,0 +1,514 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+/*
+SIFTCore.h
+
+The SIFT engine shared by OPSIFT, ColorHistSIFT, HueSatSIFT and NEWSIFT: keypoint detection in
+the DoG pyramid of a ScaleSpace, orientation assignment, and the descriptor pipeline of window
+sampling, histogram voting and normalization. The extractors differ only in the pyramid their
+descriptors are sampled from and in what each sample votes for, which every extractor supplies
+as a descriptor policy. The descriptor loops are templates on the policy and on the descriptor
+width, so each extractor gets its own copy with its sampling and voting kernels inlined and the
+histogram geometry fixed at compile time; calcSIFTDescriptors picks the copy for the width asked for.
+
+A descriptor policy is a struct with
+    PYRAMID     the ScaleSpace pyramid the descriptors are sampled from
+    CHANNELS    number of floats stored per sample
+    BINS        number of histogram bins per spatial bin
+    PARTS       number of D x D x BINS histograms the descriptor is made of, each normalized on its
+                own and stored after the one before; part p starts at hist + p*(D + 2)*(D + 2)*(BINS + 2)
+    WEIGHTED    true if the votes are weighted by the Gaussian window
+    sampleRow<T> stores the channels of the samples (r, x + j0) .. (r, x + j1) at ch[c][k] onwards,
+                from a pyramid of element type T (float, or short for a fixed-point pyramid)
+    prepare     transforms the stored channels of all len samples at once, before voting
+    DENSE_MAP   true if prepare leaves a magnitude in ch[1] and an angle in ch[2] that depend on
+                the sample's pixel alone. A level read by many keypoints then gets a dense map of
+                both, computed once, which the descriptors gather from instead of sampling the level.
+                The maps are kept with the pyramid, so at most one such policy may read a pyramid
+    vote<D>     adds sample k, of window weight w, to the spatial bins (r0, c0) .. (r0 + 1, c0 + 1)
+                of a D x D descriptor with the fractional offsets rbin and cbin; ori is the keypoint
+                orientation
+*/
+
+#ifndef SIFT_CORE_H
+#define SIFT_CORE_H
+
+#include "opencv2/opencv.hpp"
+#include "ScaleSpace.h"
+#include "DescriptorScratch.h"
+#include "DescriptorSampling.h"
+#include <vector>
+using namespace std;
+
+namespace cv
+{
+	/******************************* Defs and macros *****************************/
+
+	// default number of sampled intervals per octave
+	static const int NEWSIFT_INTVLS = 3;
+
+	// default sigma for initial gaussian smoothing
+	static const float NEWSIFT_SIGMA = 1.6f;
+
+	// default threshold on keypoint contrast |D(x)|
+	static const float NEWSIFT_CONTR_THR = 0.04f;
+
+	// default threshold on keypoint ratio of principle curvatures
+	static const float NEWSIFT_CURV_THR = 10.f;
+
+	// double image size before pyramid construction?
+	static const bool NEWSIFT_IMG_DBL = true;
+
+	// default width of descriptor histogram array; 2 is also supported
+	static const int NEWSIFT_DESCR_WIDTH = 4;
+
+	// default number of bins per histogram in descriptor array
+	static const int NEWSIFT_DESCR_HIST_BINS = 8;
+
+	// a level gets a dense map once its keypoints' windows cover this many times its pixels
+	static const float NEWSIFT_DENSE_MAP_RATIO = 1.f;
+
+	// assumed gaussian blur for input image
+	static const float NEWSIFT_INIT_SIGMA = 0.5f;
+
+	// width of border in which to ignore keypoints
+	static const int NEWSIFT_IMG_BORDER = 5;
+
+	// maximum steps of keypoint interpolation before failure
+	static const int NEWSIFT_MAX_INTERP_STEPS = 5;
+
+	// default number of bins in histogram for orientation assignment
+	static const int NEWSIFT_ORI_HIST_BINS = 36;
+
+	// determines gaussian sigma for orientation assignment
+	static const float NEWSIFT_ORI_SIG_FCTR = 1.5f;
+
+	// determines the radius of the region used in orientation assignment
+	static const float NEWSIFT_ORI_RADIUS = 3 * NEWSIFT_ORI_SIG_FCTR;
+
+	// orientation magnitude relative to max that results in new feature
+	static const float NEWSIFT_ORI_PEAK_RATIO = 0.8f;
+
+	// determines the size of a single descriptor orientation histogram
+	static const float NEWSIFT_DESCR_SCL_FCTR = 3.f;
+
+	// threshold on magnitude of elements of descriptor vector
+	static const float NEWSIFT_DESCR_MAG_THR = 0.2f;
+
+	// factor used to convert floating-point descriptor to unsigned char
+	static const float NEWSIFT_INT_DESCR_FCTR = 512.f;
+
+	// intensity scale of the 16-bit fixed-point pyramids
+	static const int NEWSIFT_FIXPT_SCALE = 48;
+
+	// Scales of the values a pyramid of element type T holds. Float pyramids hold grey and BGR
+	// intensities in [0, 255] and the chroma vector (S cos H, S sin H) of hue H and saturation S,
+	// whose components are in [-1, 1]. Fixed-point (short)
+	// pyramids hold them multiplied by the scales below, which keep them under 2^15 (DoG
+	// differences included) while using most of the 16 bits
+	template <typename T> struct PyramidScale;
+
+	template <> struct PyramidScale<float>
+	{
+		enum { INTENSITY = 1, CHROMA = 1 };
+	};
+
+	template <> struct PyramidScale<short>
+	{
+		enum { INTENSITY = NEWSIFT_FIXPT_SCALE, CHROMA = 16384 };
+	};
+
+	// Parameters every SIFT extractor is constructed with
+	struct SIFTParams
+	{
+		int nfeatures;
+		int nOctaveLayers;
+		double contrastThreshold;
+		double edgeThreshold;
+		double sigma;
+		// CV_32F or CV_8U
+		int descType;
+		// threads computing descriptors: 1 runs serially, 0 lets OpenCV decide
+		int nThreads;
+		// width of the descriptor's spatial histogram array, 2 or 4
+		int descrWidth;
+		// whether densely sampled levels get dense maps, for policies with DENSE_MAP
+		bool denseMaps;
+	};
+
+	static inline void
+		unpackOctave(const KeyPoint& kpt, int& octave, int& layer, float& scale)
+	{
+		octave = kpt.octave & 255;
+		layer = (kpt.octave >> 8) & 255;
+		octave = octave < 128 ? octave : (-128 | octave);
+		scale = octave >= 0 ? 1.f / (1 << octave) : (float)(1 << -octave);
+	}
+
+	// Detects features at extrema in DoG scale space, with their orientations. The pyramids may be
+	// float or fixed point (CV_16S)
+	void findSIFTScaleSpaceExtrema(const vector<Mat>& gauss_pyr, const vector<Mat>& dog_pyr,
+		vector<KeyPoint>& keypoints, int nOctaveLayers, double contrastThreshold,
+		double edgeThreshold, double sigma);
+
+	// First octave of the scale space to describe keypoints from: -1 (the doubled image) for
+	// detection, otherwise the lowest octave the provided keypoints refer to
+	int siftFirstOctave(const vector<KeyPoint>& keypoints, bool useProvidedKeypoints, int nOctaveLayers);
+
+	// Detects the keypoints of a scale space, keeps the nfeatures best (if nfeatures > 0) and
+	// filters them by mask. The keypoints are returned in the coordinates of the original image
+	void detectSIFTKeypoints(ScaleSpace& scaleSpace, const Mat& mask, vector<KeyPoint>& keypoints,
+		const SIFTParams& params);
+
+	// Folds the circular bins of a (d + 2) x (d + 2) x (n + 2) voting histogram into the d x d x n
+	// descriptor dst, clips and normalizes it and scales it to [0, 255]. dst is the float work row;
+	// 8-bit descriptors are stored straight into dst8 if it is not null
+	void finalizeSIFTDescriptor(float* hist, int d, int n, float* dst, uchar* dst8);
+
+	// Returns true if the descriptors can be D x D spatial bins wide
+	static inline bool isSIFTDescriptorWidth(int d)
+	{
+		return d == 2 || d == 4;
+	}
+
+	// Copies the magnitudes and angles of samples (r, x + j0) .. (r, x + j1) from a dense map to
+	// ch[1] and ch[2] at index k onwards, where the policy's prepare would have left them
+	static inline void gatherMapRow(const Mat& map, int r, int x, int j0, int j1, float* const* ch, int k)
+	{
+		const Vec2f* mapRow = map.ptr<Vec2f>(r) + x;
+		float *mag = ch[1], *ang = ch[2];
+		for (int j = j0; j <= j1; j++, k++)
+		{
+			mag[k] = mapRow[j][0];
+			ang[k] = mapRow[j][1];
+		}
+	}
+
+	// Computes the descriptor of one keypoint from pyramid level img.
+	// map: dense map of the level, or an empty Mat to sample the level itself
+	// ptf: keypoint position in the level
+	// ori: angle (degree) of the keypoint relative to the coordinates, clockwise
+	// scl: radius of meaningful neighborhood around the keypoint
+	// D: descriptor width; the policy's BINS are the bins per spatial bin
+	// T: element type of the pyramid
+	template <class Policy, int D, typename T>
+	void calcSIFTDescriptor(const Mat& img, const Mat& map, Point2f ptf, float ori, float scl,
+		float* dst, uchar* dst8, DescriptorScratch& scratch)
+	{
+		const int d = D, n = Policy::BINS;
+		Point pt(cvRound(ptf.x), cvRound(ptf.y));
+		float cos_t = cosf(ori*(float)(CV_PI / 180));
+		float sin_t = sinf(ori*(float)(CV_PI / 180));
+		float exp_scale = -1.f / (d * d * 0.5f);
+		float hist_width = NEWSIFT_DESCR_SCL_FCTR * scl;
+		int radius = cvRound(hist_width * 1.4142135623730951f * (d + 1) * 0.5f);
+		// Clip the radius to the diagonal of the image to avoid autobuffer too large exception
+		radius = std::min(radius, (int)sqrt((double)img.cols*img.cols + img.rows*img.rows));
+		cos_t /= hist_width;
+		sin_t /= hist_width;
+
+		int i, k, len = (radius * 2 + 1)*(radius * 2 + 1), histlen = (d + 2)*(d + 2)*(n + 2);
+		int rows = img.rows, cols = img.cols;
+
+		// the policy's channels, then the window weights, the bin coordinates and the histograms
+		float* buf = scratch.buffer(len * (Policy::CHANNELS + 3) + Policy::PARTS*histlen);
+		float* ch[Policy::CHANNELS];
+		for (int c = 0; c < Policy::CHANNELS; c++)
+			ch[c] = buf + c*len;
+		float *W = buf + Policy::CHANNELS*len, *RBin = W + len, *CBin = RBin + len, *hist = CBin + len;
+
+		std::fill(hist, hist + Policy::PARTS*histlen, 0.f);
+
+		// only the columns inside the rotated window are visited; c stays in (0, cols - 1)
+		int jlo = std::max(-radius, 1 - pt.x), jhi = std::min(radius, cols - 2 - pt.x);
+		for (i = -radius, k = 0; i <= radius; i++)
+		{
+			int r = pt.y + i;
+			int j0, j1;
+			if (r <= 0 || r >= rows - 1 || !descriptorRowSpan(i, jlo, jhi, cos_t, sin_t, d, j0, j1))
+				continue;
+			// Calculate the samples' histogram array coords rotated relative to ori.
+			descriptorRowBins(i, j0, j1, cos_t, sin_t, d, exp_scale, RBin + k, CBin + k, Policy::WEIGHTED ? W + k : 0);
+			if (Policy::DENSE_MAP && !map.empty())
+				gatherMapRow(map, r, pt.x, j0, j1, ch, k);
+			else
+				Policy::template sampleRow<T>(img, r, pt.x, j0, j1, ch, k);
+			k += j1 - j0 + 1;
+		}
+
+		len = k;
+		if (!Policy::DENSE_MAP || map.empty())
+			Policy::prepare(ch, len);
+		if (Policy::WEIGHTED)
+			hal::exp(W, W, len);
+
+		for (k = 0; k < len; k++)
+		{
+			float rbin = RBin[k], cbin = CBin[k];
+			int r0 = cvFloor(rbin);
+			int c0 = cvFloor(cbin);
+			rbin -= r0;
+			cbin -= c0;
+			Policy::template vote<D>(hist, ch, Policy::WEIGHTED ? W[k] : 1.f, k, r0, c0, rbin, cbin, ori);
+		}
+
+		for (int p = 0; p < Policy::PARTS; p++)
+			finalizeSIFTDescriptor(hist + p*histlen, d, n, dst + p*d*d*n, dst8 ? dst8 + p*d*d*n : 0);
+	}
+
+	// Computes the descriptors of a range of keypoints. Every keypoint writes only its own
+	// descriptor row, so ranges can run concurrently and give the same output as a serial loop
+	template <class Policy, int D, typename T>
+	class SIFTDescriptorComputer : public ParallelLoopBody
+	{
+	public:
+		SIFTDescriptorComputer(const vector<Mat>& _gpyr, const vector<Mat>& _maps, const vector<KeyPoint>& _keypoints,
+			Mat& _descriptors, int _nOctaveLayers, int _firstOctave,
+			DescriptorScratch& _scratch)
+			: gpyr(_gpyr), maps(_maps), keypoints(_keypoints), descriptors(_descriptors),
+			nOctaveLayers(_nOctaveLayers), firstOctave(_firstOctave), scratch(_scratch)
+		{
+		}
+
+		void operator()(const Range& range) const
+		{
+			bool is8u = descriptors.depth() == CV_8U;
+			float buf[Policy::PARTS*D*D*Policy::BINS];
+
+			for (int i = range.start; i < range.end; i++)
+			{
+				KeyPoint kpt = keypoints[i];
+				int octave, layer;
+				float scale;
+				unpackOctave(kpt, octave, layer, scale);
+				CV_Assert(octave >= firstOctave && layer <= nOctaveLayers + 2);
+				float size = kpt.size*scale;
+				Point2f ptf(kpt.pt.x*scale, kpt.pt.y*scale);
+				int level = (octave - firstOctave)*(nOctaveLayers + 3) + layer;
+				const Mat& img = gpyr[level];
+
+				float angle = 360.f - kpt.angle;
+				if (std::abs(angle - 360.f) < FLT_EPSILON)
+					angle = 0.f;
+				calcSIFTDescriptor<Policy, D, T>(img, maps[level], ptf, angle, size*0.5f, is8u ? buf : descriptors.ptr<float>((int)i),
+					is8u ? descriptors.ptr<uchar>((int)i) : 0, scratch);
+			}
+		}
+
+	private:
+		const vector<Mat>& gpyr;
+		const vector<Mat>& maps;
+		const vector<KeyPoint>& keypoints;
+		Mat& descriptors;
+		int nOctaveLayers;
+		int firstOctave;
+		DescriptorScratch& scratch;
+	};
+
+	template <class Policy, int D, typename T>
+	void calcSIFTDescriptors(const vector<Mat>& gpyr, const vector<Mat>& maps, const vector<KeyPoint>& keypoints,
+		Mat& descriptors, int nOctaveLayers, int firstOctave, int nThreads,
+		DescriptorScratch& scratch)
+	{
+		SIFTDescriptorComputer<Policy, D, T> computer(gpyr, maps, keypoints, descriptors, nOctaveLayers, firstOctave, scratch);
+		Range range(0, (int)keypoints.size());
+
+		// a single thread runs the plain loop; otherwise split the keypoints into nThreads
+		// stripes, which caps how many threads work on them at once (0 lets OpenCV decide)
+		if (nThreads == 1)
+			computer(range);
+		else
+			parallel_for_(range, computer, nThreads > 1 ? nThreads : -1);
+	}
+
+	template <class Policy, typename T>
+	void calcSIFTDescriptors(const vector<Mat>& gpyr, const vector<Mat>& maps, const vector<KeyPoint>& keypoints,
+		Mat& descriptors, int nOctaveLayers, int firstOctave, int d, int nThreads,
+		DescriptorScratch& scratch)
+	{
+		switch (d)
+		{
+		case 2:
+			calcSIFTDescriptors<Policy, 2, T>(gpyr, maps, keypoints, descriptors, nOctaveLayers, firstOctave, nThreads, scratch);
+			break;
+		case 4:
+			calcSIFTDescriptors<Policy, 4, T>(gpyr, maps, keypoints, descriptors, nOctaveLayers, firstOctave, nThreads, scratch);
+			break;
+		default:
+			CV_Error(CV_StsBadArg, "unsupported descriptor width (!=2, 4)");
+		}
+	}
+
+	// Computes the descriptors with the kernels compiled for descriptor width d and a pyramid
+	// of the given depth, CV_32F or CV_16S. maps holds the dense maps of the levels that have one
+	template <class Policy>
+	void calcSIFTDescriptors(const vector<Mat>& gpyr, const vector<Mat>& maps, const vector<KeyPoint>& keypoints,
+		Mat& descriptors, int nOctaveLayers, int firstOctave, int d, int depth, int nThreads,
+		DescriptorScratch& scratch)
+	{
+		if (depth == CV_16S)
+			calcSIFTDescriptors<Policy, short>(gpyr, maps, keypoints, descriptors, nOctaveLayers, firstOctave, d, nThreads, scratch);
+		else
+			calcSIFTDescriptors<Policy, float>(gpyr, maps, keypoints, descriptors, nOctaveLayers, firstOctave, d, nThreads, scratch);
+	}
+
+	// Computes rows of the dense map of a level. Every row is sampled and prepared as a descriptor
+	// would sample and prepare it, over the columns 1 .. cols - 2 that descriptors read
+	template <class Policy, typename T>
+	class DenseMapComputer : public ParallelLoopBody
+	{
+	public:
+		DenseMapComputer(const Mat& _img, Mat& _map) : img(_img), map(_map)
+		{
+		}
+
+		void operator()(const Range& range) const
+		{
+			int len = img.cols - 2;
+			AutoBuffer<float> _buf(len * Policy::CHANNELS);
+			float* ch[Policy::CHANNELS];
+			for (int c = 0; c < Policy::CHANNELS; c++)
+				ch[c] = (float*)_buf + c*len;
+
+			for (int r = range.start; r < range.end; r++)
+			{
+				Policy::template sampleRow<T>(img, r, 0, 1, img.cols - 2, ch, 0);
+				Policy::prepare(ch, len);
+				Vec2f* mapRow = map.ptr<Vec2f>(r) + 1;
+				for (int j = 0; j < len; j++)
+					mapRow[j] = Vec2f(ch[1][j], ch[2][j]);
+			}
+		}
+
+	private:
+		const Mat& img;
+		Mat& map;
+	};
+
+	// Gives a dense map to every level of the policy's pyramid whose keypoints sample it densely
+	// enough that computing every pixel once costs no more than sampling their windows. Levels
+	// that already have a map keep it
+	template <class Policy>
+	void buildDenseMaps(ScaleSpace& scaleSpace, const vector<KeyPoint>& keypoints, const SIFTParams& params)
+	{
+		const vector<Mat>& gpyr = scaleSpace.pyramid(Policy::PYRAMID);
+		vector<Mat>& maps = scaleSpace.denseMaps(Policy::PYRAMID);
+		int firstOctave = scaleSpace.firstOctave(), d = params.descrWidth;
+
+		// pixels in the rotated windows of the keypoints of every level
+		vector<double> sampled(gpyr.size(), 0.);
+		for (size_t i = 0; i < keypoints.size(); i++)
+		{
+			int octave, layer;
+			float scale;
+			unpackOctave(keypoints[i], octave, layer, scale);
+			float side = NEWSIFT_DESCR_SCL_FCTR * keypoints[i].size*scale*0.5f * (d + 1);
+			sampled[(octave - firstOctave)*(params.nOctaveLayers + 3) + layer] += (double)side*side;
+		}
+
+		for (size_t i = 0; i < gpyr.size(); i++)
+		{
+			const Mat& img = gpyr[i];
+			if (!maps[i].empty() || img.rows < 3 || img.cols < 3 || sampled[i] < NEWSIFT_DENSE_MAP_RATIO*img.total())
+				continue;
+			// the border rows and columns are never read
+			maps[i] = Mat::zeros(img.size(), CV_32FC2);
+			Range rows(1, img.rows - 1);
+			int nstripes = params.nThreads > 1 ? params.nThreads : -1;
+			if (scaleSpace.depth() == CV_16S)
+			{
+				DenseMapComputer<Policy, short> computer(img, maps[i]);
+				if (params.nThreads == 1)
+					computer(rows);
+				else
+					parallel_for_(rows, computer, nstripes);
+			}
+			else
+			{
+				DenseMapComputer<Policy, float> computer(img, maps[i]);
+				if (params.nThreads == 1)
+					computer(rows);
+				else
+					parallel_for_(rows, computer, nstripes);
+			}
+		}
+	}
+
+	// Detects keypoints in a scale space, unless useProvidedKeypoints is set, and computes their
+	// descriptors if they are needed. Only the levels the descriptors read are built. Returns the
+	// bytes this call made the scratch arena allocate
+	template <class Policy>
+	size_t runSIFT(ScaleSpace& scaleSpace, InputArray _mask, vector<KeyPoint>& keypoints,
+		OutputArray _descriptors, bool useProvidedKeypoints, const SIFTParams& params,
+		DescriptorScratchArena& arena)
+	{
+		Mat mask = _mask.getMat();
+
+		if (!mask.empty() && mask.type() != CV_8UC1)
+			CV_Error(CV_StsBadArg, "mask has incorrect type (!=CV_8UC1)");
+
+		CV_Assert(scaleSpace.nOctaveLayers() == params.nOctaveLayers && scaleSpace.sigma() == params.sigma);
+
+		if (!useProvidedKeypoints)
+			detectSIFTKeypoints(scaleSpace, mask, keypoints, params);
+
+		if (_descriptors.needed())
+		{
+			scaleSpace.prepare(Policy::PYRAMID, keypoints);
+			if (Policy::DENSE_MAP && params.denseMaps)
+				buildDenseMaps<Policy>(scaleSpace, keypoints, params);
+
+			int dsize = Policy::PARTS*params.descrWidth*params.descrWidth*Policy::BINS;
+			_descriptors.create((int)keypoints.size(), dsize, params.descType);
+			Mat descriptors = _descriptors.getMat();
+
+			DescriptorScratch scratch(arena);
+			calcSIFTDescriptors<Policy>(scaleSpace.pyramid(Policy::PYRAMID), scaleSpace.denseMaps(Policy::PYRAMID), keypoints, descriptors,
+				params.nOctaveLayers, scaleSpace.firstOctave(), params.descrWidth, scaleSpace.depth(), params.nThreads, scratch);
+			return scratch.allocatedBytes();
+		}
+		return 0;
+	}
+}
+
+#endif
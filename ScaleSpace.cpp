@@ -0,0 +1,913 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+/*
+ScaleSpace.cpp
+
+Lazily built scale-space pyramids shared by detection and all descriptor types of one image.
+The pyramid construction follows the OpenCV SIFT implementation the extractors are based on.
+*/
+
+#include "ScaleSpace.h"
+#include "SIFTCore.h"
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace cv
+{
+	// Returns the Gaussian kernel GaussianBlur would build for sigma and an image of the given
+	// depth. A pyramid blurs with the same few sigmas at every octave of every image, so the
+	// kernels are built once per process and shared
+	static const Mat& gaussianKernel(double sigma, int depth)
+	{
+		static map<pair<double, int>, Mat> kernels;
+		static mutex kernelLock;
+
+		lock_guard<mutex> lock(kernelLock);
+		Mat& kernel = kernels[make_pair(sigma, depth)];
+		if (kernel.empty())
+		{
+			int ksize = cvRound(sigma*(depth == CV_8U ? 3 : 4) * 2 + 1) | 1;
+			kernel = getGaussianKernel(ksize, sigma, std::max(depth, CV_32F));
+		}
+		return kernel;
+	}
+
+	// Blurs rows r0 .. r1 - 1 of a float image with a symmetric kernel, all interleaved channels
+	// in one pass, into the r1 - r0 rows of dst. Each output row is first summed vertically into a row buffer, whose ends are
+	// then padded by reflection (as BORDER_DEFAULT does) so that the horizontal pass runs over
+	// the whole interleaved row without per-channel or border branches. Every row is computed
+	// the same way whatever range it is in, so the image may be blurred in bands
+	static void blurRows32f(const Mat& src, Mat& dst, const Mat& kernel, int r0, int r1)
+	{
+		int cn = src.channels(), len = src.cols*cn;
+		int radius = (int)kernel.total() / 2, pad = radius*cn;
+		// k[0] is the center tap; the kernel is symmetric, k[-i] == k[i]
+		const float* k = kernel.ptr<float>() + radius;
+
+		AutoBuffer<float> _row(len + 2 * pad);
+		float* row = _row + pad;
+		AutoBuffer<const float*> _above(radius + 1), _below(radius + 1);
+		const float **above = _above, **below = _below;
+		// source pixel of every pad pixel, counted in floats
+		AutoBuffer<int> _padOfs(2 * pad + 1);
+		int* padOfs = _padOfs;
+		for (int x = 0; x < radius; x++)
+		{
+			int left = borderInterpolate(x - radius, src.cols, BORDER_DEFAULT);
+			int right = borderInterpolate(src.cols + x, src.cols, BORDER_DEFAULT);
+			for (int c = 0; c < cn; c++)
+			{
+				padOfs[x*cn + c] = left*cn + c;
+				padOfs[pad + x*cn + c] = right*cn + c;
+			}
+		}
+
+		for (int y = r0; y < r1; y++)
+		{
+			const float* center = src.ptr<float>(y);
+			for (int i = 1; i <= radius; i++)
+			{
+				above[i] = src.ptr<float>(borderInterpolate(y - i, src.rows, BORDER_DEFAULT));
+				below[i] = src.ptr<float>(borderInterpolate(y + i, src.rows, BORDER_DEFAULT));
+			}
+
+			int j = 0;
+#if CV_AVX
+			for (; j <= len - 8; j += 8)
+			{
+				__m256 s = _mm256_mul_ps(_mm256_set1_ps(k[0]), _mm256_loadu_ps(center + j));
+				for (int i = 1; i <= radius; i++)
+					s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_set1_ps(k[i]),
+						_mm256_add_ps(_mm256_loadu_ps(above[i] + j), _mm256_loadu_ps(below[i] + j))));
+				_mm256_storeu_ps(row + j, s);
+			}
+#elif CV_SSE2
+			for (; j <= len - 4; j += 4)
+			{
+				__m128 s = _mm_mul_ps(_mm_set1_ps(k[0]), _mm_loadu_ps(center + j));
+				for (int i = 1; i <= radius; i++)
+					s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(k[i]),
+						_mm_add_ps(_mm_loadu_ps(above[i] + j), _mm_loadu_ps(below[i] + j))));
+				_mm_storeu_ps(row + j, s);
+			}
+#endif
+			for (; j < len; j++)
+			{
+				float s = k[0] * center[j];
+				for (int i = 1; i <= radius; i++)
+					s += k[i] * (above[i][j] + below[i][j]);
+				row[j] = s;
+			}
+
+			for (int x = 0; x < pad; x++)
+			{
+				row[x - pad] = row[padOfs[x]];
+				row[len + x] = row[padOfs[pad + x]];
+			}
+
+			float* out = dst.ptr<float>(y - r0);
+			j = 0;
+#if CV_AVX
+			for (; j <= len - 8; j += 8)
+			{
+				__m256 s = _mm256_mul_ps(_mm256_set1_ps(k[0]), _mm256_loadu_ps(row + j));
+				for (int i = 1; i <= radius; i++)
+					s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_set1_ps(k[i]),
+						_mm256_add_ps(_mm256_loadu_ps(row + j - i*cn), _mm256_loadu_ps(row + j + i*cn))));
+				_mm256_storeu_ps(out + j, s);
+			}
+#elif CV_SSE2
+			for (; j <= len - 4; j += 4)
+			{
+				__m128 s = _mm_mul_ps(_mm_set1_ps(k[0]), _mm_loadu_ps(row + j));
+				for (int i = 1; i <= radius; i++)
+					s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(k[i]),
+						_mm_add_ps(_mm_loadu_ps(row + j - i*cn), _mm_loadu_ps(row + j + i*cn))));
+				_mm_storeu_ps(out + j, s);
+			}
+#endif
+			for (; j < len; j++)
+			{
+				float s = k[0] * row[j];
+				for (int i = 1; i <= radius; i++)
+					s += k[i] * (row[j - i*cn] + row[j + i*cn]);
+				out[j] = s;
+			}
+		}
+	}
+
+	// Blurs rows r0 .. r1 - 1 of src into dst, which must have r1 - r0 rows and src's width and
+	// type, with the cached kernel of sigma. Other depths than float go through sepFilter2D on
+	// the band, which reads the rows around it from the whole image
+	static void blurRows(const Mat& src, Mat& dst, double sigma, int r0, int r1)
+	{
+		const Mat& kernel = gaussianKernel(sigma, src.depth());
+		if (src.depth() == CV_32F)
+			blurRows32f(src, dst, kernel, r0, r1);
+		else
+			sepFilter2D(src.rowRange(r0, r1), dst, -1, kernel, kernel);
+	}
+
+	static void blurImage(const Mat& src, Mat& dst, double sigma)
+	{
+		dst.create(src.size(), src.type());
+		blurRows(src, dst, sigma, 0, src.rows);
+	}
+
+	// Scale of the grey and BGR intensities of a pyramid of the given depth
+	static inline int intensityScale(int depth)
+	{
+		return depth == CV_16S ? PyramidScale<short>::INTENSITY : PyramidScale<float>::INTENSITY;
+	}
+
+	static Mat createInitialImage(const Mat& img, bool doubleImageSize, float sigma, int depth)
+	{
+		Mat gray, gray_fpt;
+		if (img.channels() == 3 || img.channels() == 4)
+			cvtColor(img, gray, COLOR_BGR2GRAY);
+		else
+			img.copyTo(gray);
+		gray.convertTo(gray_fpt, depth, intensityScale(depth), 0);
+
+		float sig_diff;
+
+		if (doubleImageSize)
+		{
+			sig_diff = sqrtf(std::max(sigma * sigma - NEWSIFT_INIT_SIGMA * NEWSIFT_INIT_SIGMA * 4, 0.01f));
+			Mat dbl, blurred;
+			resize(gray_fpt, dbl, Size(gray.cols * 2, gray.rows * 2), 0, 0, INTER_LINEAR);
+			blurImage(dbl, blurred, sig_diff);
+			return blurred;
+		}
+		else
+		{
+			sig_diff = sqrtf(std::max(sigma * sigma - NEWSIFT_INIT_SIGMA * NEWSIFT_INIT_SIGMA, 0.01f));
+			Mat blurred;
+			blurImage(gray_fpt, blurred, sig_diff);
+			return blurred;
+		}
+	}
+
+	// Blur that takes the base image from the blur it is assumed to have to sigma
+	static inline float baseSigmaDiff(bool doubleImageSize, float sigma)
+	{
+		float initSigma = NEWSIFT_INIT_SIGMA * (doubleImageSize ? 2 : 1);
+		return sqrtf(std::max(sigma * sigma - initSigma * initSigma, 0.01f));
+	}
+
+	// color base image before its blur: the image at the pyramid depth and, doubled, at twice its size
+	static Mat createUnblurredColorImage(const Mat& img, bool doubleImageSize, int depth)
+	{
+		Mat color_fpt;
+		img.convertTo(color_fpt, depth, intensityScale(depth), 0);
+		if (!doubleImageSize)
+			return color_fpt;
+		Mat dbl;
+		resize(color_fpt, dbl, Size(img.cols * 2, img.rows * 2), 0, 0, INTER_LINEAR);
+		return dbl;
+	}
+
+	// initialize color base image for calculating color gaussian pyramid
+	static Mat createInitialColorImage(const Mat& img, bool doubleImageSize, float sigma, int depth)
+	{
+		Mat blurred;
+		blurImage(createUnblurredColorImage(img, doubleImageSize, depth), blurred, baseSigmaDiff(doubleImageSize, sigma));
+		return blurred;
+	}
+
+	// Converts a row of 8-bit BGR pixels to the opponent colors O1 = (R - G)/2,
+	// O2 = (R + G - 2B)/4 and O3 = (R + G + B)/3, scaled by scale
+	template <typename T>
+	static void opponentRow(const uchar* bgr, T* opp, int width, float scale)
+	{
+		for (int x = 0; x < width; x++, bgr += 3, opp += 3)
+		{
+			int b = bgr[0], g = bgr[1], r = bgr[2];
+			opp[0] = saturate_cast<T>((r - g)*(0.5f*scale));
+			opp[1] = saturate_cast<T>((r + g - 2 * b)*(0.25f*scale));
+			opp[2] = saturate_cast<T>((r + g + b)*(scale / 3));
+		}
+	}
+
+	// initialize the opponent base image: every pixel is converted straight to the pyramid
+	// depth in one pass, then doubled and blurred as the color base is
+	static Mat createInitialOpponentImage(const Mat& img, bool doubleImageSize, float sigma, int depth)
+	{
+		Mat bgr = img;
+		if (img.channels() == 1)
+			cvtColor(img, bgr, COLOR_GRAY2BGR);
+		else if (img.channels() == 4)
+			cvtColor(img, bgr, COLOR_BGRA2BGR);
+
+		Mat opp(bgr.size(), CV_MAKETYPE(depth, 3));
+		float scale = (float)intensityScale(depth);
+		for (int r = 0; r < bgr.rows; r++)
+		{
+			if (depth == CV_16S)
+				opponentRow(bgr.ptr<uchar>(r), opp.ptr<short>(r), bgr.cols, scale);
+			else
+				opponentRow(bgr.ptr<uchar>(r), opp.ptr<float>(r), bgr.cols, scale);
+		}
+
+		if (doubleImageSize)
+		{
+			Mat dbl;
+			resize(opp, dbl, Size(bgr.cols * 2, bgr.rows * 2), 0, 0, INTER_LINEAR);
+			opp = dbl;
+		}
+		Mat blurred;
+		blurImage(opp, blurred, baseSigmaDiff(doubleImageSize, sigma));
+		return blurred;
+	}
+
+	// Computes the hue and saturation of a row of BGR pixels as cvtColor(CV_BGR2HSV) does for
+	// float pixels, leaving out the value. Both are invariant to the scale of the pixels, so
+	// fixed-point pixels are converted as they are
+	template <typename T>
+	static void hueSatRow(const T* bgr, float* hue, float* sat, int width)
+	{
+		for (int x = 0; x < width; x++, bgr += 3)
+		{
+			float b = bgr[0], g = bgr[1], r = bgr[2];
+			float v = std::max(std::max(r, g), b), vmin = std::min(std::min(r, g), b);
+			float diff = v - vmin;
+			float s = diff / (float)(fabs(v) + FLT_EPSILON);
+			diff = (float)(60. / (diff + FLT_EPSILON));
+			float h;
+			if (v == r)
+				h = (g - b)*diff;
+			else if (v == g)
+				h = (b - r)*diff + 120.f;
+			else
+				h = (r - g)*diff + 240.f;
+			if (h < 0)
+				h += 360.f;
+			hue[x] = h;
+			sat[x] = s;
+		}
+	}
+
+	// Converts BGR pixels to the chroma vector (S cos H, S sin H) of their hue H and saturation S,
+	// into a two-channel chroma of bgr's size and depth. Unlike hue, the vector can be blurred
+	// linearly: hues on either side of 0 degrees average to red rather than to cyan
+	static void convertToChroma(const Mat& bgr, Mat& chroma)
+	{
+		int width = bgr.cols;
+		AutoBuffer<float> _buf(width * 4);
+		Mat hue(1, width, CV_32F, (float*)_buf), sat(1, width, CV_32F, (float*)_buf + width);
+		Mat cx(1, width, CV_32F, (float*)_buf + width * 2), cy(1, width, CV_32F, (float*)_buf + width * 3);
+		for (int r = 0; r < bgr.rows; r++)
+		{
+			if (bgr.depth() == CV_16S)
+				hueSatRow(bgr.ptr<short>(r), hue.ptr<float>(), sat.ptr<float>(), width);
+			else
+				hueSatRow(bgr.ptr<float>(r), hue.ptr<float>(), sat.ptr<float>(), width);
+			polarToCart(sat, hue, cx, cy, true);
+			Mat planes[] = { cx, cy }, row = chroma.row(r);
+			if (chroma.depth() == CV_16S)
+			{
+				// interleave and scale to fixed point in one conversion
+				Mat rowf;
+				merge(planes, 2, rowf);
+				rowf.convertTo(row, CV_16S, PyramidScale<short>::CHROMA);
+			}
+			else
+				merge(planes, 2, row);
+		}
+	}
+
+	// Blurs rows r0 .. r1 - 1 of a BGR image and converts them to chroma vectors, into the same
+	// rows of a two-channel chroma. A few rows are blurred at a time into a small buffer and
+	// converted while they are in cache, so the blurred BGR image is never stored
+	static void blurRowsToChroma(const Mat& bgr, Mat& chroma, double sigma, int r0, int r1)
+	{
+		const int CHUNK_ROWS = 8;
+		Mat blurred(std::min(CHUNK_ROWS, r1 - r0), bgr.cols, bgr.type());
+		for (int y = r0; y < r1; y += CHUNK_ROWS)
+		{
+			int y1 = std::min(y + CHUNK_ROWS, r1);
+			Mat chunk = blurred.rowRange(0, y1 - y);
+			blurRows(bgr, chunk, sigma, y, y1);
+			Mat out = chroma.rowRange(y, y1);
+			convertToChroma(chunk, out);
+		}
+	}
+
+	namespace
+	{
+		// bands are at least this many rows high, well above the height of the blur kernels
+		const int MIN_BAND_ROWS = 64;
+
+		// A dependency graph of pyramid tasks, run by a pool of workers. A task becomes ready
+		// once every task it depends on is done; it is then split into bands of rows that any
+		// worker may run. Workers that find no ready band wait for the running ones, and all of
+		// them return once nothing is running and nothing is ready
+		class PyramidBuilder : public ParallelLoopBody
+		{
+		public:
+			explicit PyramidBuilder(int _nWorkers) : nWorkers(_nWorkers), running(0)
+			{
+			}
+
+			// Adds a task and returns its id. start is called once the task is ready, to allocate
+			// its output, and returns the number of bands; run computes band i of n
+			int add(const function<int()>& start, const function<void(int, int)>& run)
+			{
+				Task t;
+				t.start = start;
+				t.run = run;
+				t.pending = 0;
+				t.remaining = 0;
+				tasks.push_back(t);
+				return (int)tasks.size() - 1;
+			}
+
+			// Adds a task that runs as one piece
+			int add(const function<void()>& run)
+			{
+				return add([]() { return 1; }, [run](int, int) { run(); });
+			}
+
+			// Makes task after wait for task before; before may be -1 for a level already built
+			void depend(int before, int after)
+			{
+				if (before < 0)
+					return;
+				tasks[before].next.push_back(after);
+				tasks[after].pending++;
+			}
+
+			// Number of bands to split a level of the given height into
+			int bands(int rows) const
+			{
+				return std::max(1, std::min(nWorkers, rows / MIN_BAND_ROWS));
+			}
+
+			void run()
+			{
+				for (int i = 0; i < (int)tasks.size(); i++)
+				{
+					if (tasks[i].pending == 0)
+						schedule(i);
+				}
+				if (nWorkers == 1)
+					(*this)(Range(0, 1));
+				else
+					parallel_for_(Range(0, nWorkers), *this, nWorkers);
+				if (error)
+					rethrow_exception(error);
+			}
+
+			void operator()(const Range& range) const
+			{
+				for (int w = range.start; w < range.end; w++)
+					work();
+			}
+
+		private:
+			struct Task
+			{
+				function<int()> start;
+				function<void(int, int)> run;
+				// tasks waiting for this one
+				vector<int> next;
+				// tasks this one still waits for
+				int pending;
+				int nBands;
+				// bands not finished yet
+				int remaining;
+			};
+
+			// Queues the bands of a ready task. Called without the lock held
+			void schedule(int id) const
+			{
+				Task& t = tasks[id];
+				t.nBands = t.remaining = t.start();
+				lock_guard<mutex> lock(queueLock);
+				for (int b = 0; b < t.nBands; b++)
+					ready.push_back(Band(id, b));
+			}
+
+			void work() const
+			{
+				unique_lock<mutex> lock(queueLock);
+				for (;;)
+				{
+					wakeup.wait(lock, [this] { return !ready.empty() || running == 0 || error; });
+					if (ready.empty() || error)
+						return;
+					Band band = ready.back();
+					ready.pop_back();
+					running++;
+					lock.unlock();
+
+					Task& t = tasks[band.first];
+					vector<int> started;
+					try
+					{
+						t.run(band.second, t.nBands);
+						lock.lock();
+						if (--t.remaining == 0)
+						{
+							for (size_t i = 0; i < t.next.size(); i++)
+							{
+								if (--tasks[t.next[i]].pending == 0)
+									started.push_back(t.next[i]);
+							}
+						}
+						lock.unlock();
+						// the task counts as running until its successors are queued, so that no
+						// worker returns while they are being started
+						for (size_t i = 0; i < started.size(); i++)
+							schedule(started[i]);
+					}
+					catch (...)
+					{
+						lock.lock();
+						if (!error)
+							error = current_exception();
+						lock.unlock();
+					}
+
+					lock.lock();
+					running--;
+					wakeup.notify_all();
+				}
+			}
+
+			typedef pair<int, int> Band;
+
+			int nWorkers;
+			mutable vector<Task> tasks;
+			mutable vector<Band> ready;
+			mutable int running;
+			mutable exception_ptr error;
+			mutable mutex queueLock;
+			mutable condition_variable wakeup;
+		};
+	}
+
+	// Gaussian sigmas of the layers of an octave, each blurring the layer below it further,
+	// using the following formula:
+	//  \sigma_{total}^2 = \sigma_{i}^2 + \sigma_{i-1}^2
+	static void layerSigmas(int nOctaveLayers, double sigma, vector<double>& sig)
+	{
+		sig.resize(nOctaveLayers + 3);
+		sig[0] = sigma;
+		double k = pow(2., 1. / nOctaveLayers);
+		for (int i = 1; i < nOctaveLayers + 3; i++)
+		{
+			double sig_prev = pow(k, (double)(i - 1))*sigma;
+			double sig_total = sig_prev*k;
+			sig[i] = std::sqrt(sig_total*sig_total - sig_prev*sig_prev);
+		}
+	}
+
+	// Radius of the cached kernel of sigma, the same for float and fixed-point levels
+	static inline int kernelRadius(double sigma)
+	{
+		return (int)gaussianKernel(sigma, CV_32F).total() / 2;
+	}
+
+	ScaleSpace::ScaleSpace(const Mat& image, int _firstOctave, int _nOctaveLayers, double _sigma, int _depth, int _nOctaves)
+		: img(image), firstOctv(_firstOctave), nLayers(_nOctaveLayers), sig0(_sigma), pyrDepth(_depth), nOctaves(0)
+	{
+		if (image.empty() || image.depth() != CV_8U)
+			CV_Error(CV_StsBadArg, "image is empty or has incorrect depth (!=CV_8U)");
+		CV_Assert(firstOctv >= -1 && firstOctv <= 0 && nLayers > 0 && _nOctaves >= 0);
+		CV_Assert(pyrDepth == CV_32F || pyrDepth == CV_16S);
+
+		layerSigmas(nLayers, sig0, sig);
+		ensureOctaves(_nOctaves > 0 ? _nOctaves : octaveCount(img.size(), firstOctv));
+	}
+
+	int ScaleSpace::octaveCount(Size imageSize, int firstOctave)
+	{
+		// the base is twice the image size when the first octave is -1
+		int baseCols = firstOctave < 0 ? imageSize.width * 2 : imageSize.width;
+		int baseRows = firstOctave < 0 ? imageSize.height * 2 : imageSize.height;
+		return cvRound(log((double)std::min(baseCols, baseRows)) / log(2.) - 2) - firstOctave;
+	}
+
+	int ScaleSpace::tileMargin(int firstOctave, int nOctaves, int nOctaveLayers, double sigma, int descrWidth)
+	{
+		vector<double> sig;
+		layerSigmas(nOctaveLayers, sigma, sig);
+
+		// Support of a level in base pixels: how far from a pixel of the level the base pixels
+		// its value depends on lie. The base reads one image pixel on either side when doubled
+		float initSigma = NEWSIFT_INIT_SIGMA * (firstOctave < 0 ? 2 : 1);
+		int support = kernelRadius(sqrtf(std::max((float)(sigma*sigma) - initSigma*initSigma, 0.01f)));
+		if (firstOctave < 0)
+			support += 2;
+
+		// The extremum search reads the DoG around every position an extremum is interpolated
+		// through; the descriptor reads the gradients of a layer up to nOctaveLayers around the
+		// keypoint, whose scale is below sigma * 2^((nOctaveLayers + 0.5) / nOctaveLayers)
+		float maxScale = (float)(sigma * pow(2., (nOctaveLayers + 0.5) / nOctaveLayers));
+		int descrRadius = cvCeil(NEWSIFT_DESCR_SCL_FCTR * maxScale * 1.4142135623730951f * (descrWidth + 1) * 0.5f);
+		int margin = 0;
+		for (int o = 0; o < nOctaves; o++)
+		{
+			int step = 1 << o, described = 0;
+			for (int i = 1; i < nOctaveLayers + 3; i++)
+			{
+				support += step*kernelRadius(sig[i]);
+				if (i == nOctaveLayers)
+					described = support;
+			}
+			margin = std::max(margin, support + step*(NEWSIFT_MAX_INTERP_STEPS + 1));
+			margin = std::max(margin, described + step*(descrRadius + 1));
+			// the next octave starts from layer nOctaveLayers, decimated
+			support = described;
+		}
+
+		// base pixels to image pixels
+		int scale = 1 << -std::min(firstOctave, 0);
+		return (margin + scale - 1) / scale;
+	}
+
+	int ScaleSpace::tileAlignment(int firstOctave, int nOctaves)
+	{
+		return 1 << std::max(nOctaves - 1 + firstOctave, 0);
+	}
+
+	void ScaleSpace::ensureOctaves(int n)
+	{
+		if (n <= nOctaves)
+			return;
+		nOctaves = n;
+		for (int p = 0; p < NUM_PYRAMIDS; p++)
+		{
+			pyr[p].resize(nOctaves*(nLayers + 3));
+			maps[p].resize(nOctaves*(nLayers + 3));
+		}
+	}
+
+	Mat ScaleSpace::createBase(Pyramid p)
+	{
+		switch (p)
+		{
+		case GRAY:
+			return createInitialImage(img, firstOctv < 0, (float)sig0, pyrDepth);
+		case BGR:
+			return createInitialColorImage(img, firstOctv < 0, (float)sig0, pyrDepth);
+		case HSV:
+		{
+			// chroma is converted from the BGR base if it is built, or else from the color image
+			// as it is blurred, without storing the blurred BGR base
+			const Mat& bgr = pyr[BGR][0];
+			Mat chroma;
+			if (!bgr.empty())
+			{
+				chroma.create(bgr.size(), CV_MAKETYPE(pyrDepth, 2));
+				convertToChroma(bgr, chroma);
+			}
+			else
+			{
+				Mat color = createUnblurredColorImage(img, firstOctv < 0, pyrDepth);
+				chroma.create(color.size(), CV_MAKETYPE(pyrDepth, 2));
+				blurRowsToChroma(color, chroma, baseSigmaDiff(firstOctv < 0, (float)sig0), 0, color.rows);
+			}
+			return chroma;
+		}
+		case OPPONENT:
+			return createInitialOpponentImage(img, firstOctv < 0, (float)sig0, pyrDepth);
+		default:
+			CV_Error(CV_StsBadArg, "unknown pyramid");
+		}
+		return Mat();
+	}
+
+	const Mat& ScaleSpace::level(Pyramid p, int octave, int layer)
+	{
+		CV_Assert(octave >= 0 && octave < nOctaves && layer >= 0 && layer < nLayers + 3);
+		Mat& dst = pyr[p][octave*(nLayers + 3) + layer];
+		if (!dst.empty())
+			return dst;
+
+		// the level is only stored once complete, so a failure leaves it unbuilt
+		Mat built;
+		if (octave == 0 && layer == 0)
+			built = createBase(p);
+		// base of new octave is halved image from end of previous octave
+		else if (layer == 0)
+		{
+			const Mat& src = level(p, octave - 1, nLayers);
+			resize(src, built, Size(src.cols / 2, src.rows / 2),
+				0, 0, INTER_NEAREST);
+		}
+		else
+		{
+			const Mat& src = level(p, octave, layer - 1);
+			blurImage(src, built, sig[layer]);
+		}
+		dst = built;
+		return dst;
+	}
+
+	const vector<Mat>& ScaleSpace::gaussianPyramid(Pyramid p)
+	{
+		for (int o = 0; o < nOctaves; o++)
+			level(p, o, nLayers + 2);
+		return pyr[p];
+	}
+
+	// True if levels holds n levels and every one of them is built
+	static bool allBuilt(const vector<Mat>& levels, size_t n)
+	{
+		if (levels.size() != n)
+			return false;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (levels[i].empty())
+				return false;
+		}
+		return true;
+	}
+
+	const vector<Mat>& ScaleSpace::dogPyramid()
+	{
+		if (allBuilt(dogpyr, (size_t)(nOctaves*(nLayers + 2))))
+			return dogpyr;
+
+		const vector<Mat>& gpyr = gaussianPyramid(GRAY);
+		dogpyr.resize(nOctaves*(nLayers + 2));
+
+		for (int o = 0; o < nOctaves; o++)
+		{
+			for (int i = 0; i < nLayers + 2; i++)
+			{
+				const Mat& src1 = gpyr[o*(nLayers + 3) + i];
+				const Mat& src2 = gpyr[o*(nLayers + 3) + i + 1];
+				Mat& dst = dogpyr[o*(nLayers + 2) + i];
+				if (dst.empty())
+				{
+					Mat diff;
+					subtract(src2, src1, diff, noArray(), pyrDepth);
+					dst = diff;
+				}
+			}
+		}
+		return dogpyr;
+	}
+
+	void ScaleSpace::prepare(Pyramid p, const vector<KeyPoint>& keypoints)
+	{
+		// highest layer read in every octave; building it also builds the layers below it
+		// and the octaves before it
+		vector<int> lastLayer;
+		for (size_t i = 0; i < keypoints.size(); i++)
+		{
+			int octave, layer;
+			float scale;
+			unpackOctave(keypoints[i], octave, layer, scale);
+			CV_Assert(octave >= firstOctv && layer <= nLayers + 2);
+			int o = octave - firstOctv;
+			ensureOctaves(o + 1);
+			if ((int)lastLayer.size() <= o)
+				lastLayer.resize(o + 1, -1);
+			lastLayer[o] = std::max(lastLayer[o], layer);
+		}
+
+		for (int o = 0; o < (int)lastLayer.size(); o++)
+		{
+			if (lastLayer[o] >= 0)
+				level(p, o, lastLayer[o]);
+		}
+	}
+	size_t ScaleSpace::memoryBytes() const
+	{
+		size_t bytes = 0;
+		for (int p = 0; p < NUM_PYRAMIDS; p++)
+		{
+			for (size_t i = 0; i < pyr[p].size(); i++)
+				bytes += pyr[p][i].total()*pyr[p][i].elemSize() + maps[p][i].total()*maps[p][i].elemSize();
+		}
+		for (size_t i = 0; i < dogpyr.size(); i++)
+			bytes += dogpyr[i].total()*dogpyr[i].elemSize();
+		return bytes;
+	}
+
+	void ScaleSpace::build(const vector<Pyramid>& pyramids, bool dog, int nThreads)
+	{
+		bool wanted[NUM_PYRAMIDS] = { false, false, false, false };
+		for (size_t i = 0; i < pyramids.size(); i++)
+			wanted[pyramids[i]] = true;
+		wanted[GRAY] = wanted[GRAY] || dog;
+
+		PyramidBuilder builder(nThreads > 0 ? nThreads : std::max(getNumThreads(), 1));
+		int layers = nLayers + 3;
+		// task of every level, -1 if the level is already built or not needed
+		vector<int> task[NUM_PYRAMIDS];
+
+		for (int p = 0; p < NUM_PYRAMIDS; p++)
+		{
+			task[p].assign(nOctaves*layers, -1);
+			if (!wanted[p])
+				continue;
+
+			int lastLayer = p == GRAY ? nLayers + 2 : nLayers;
+			for (int o = 0; o < nOctaves; o++)
+			{
+				for (int layer = 0; layer <= lastLayer; layer++)
+				{
+					Mat& dst = pyr[p][o*layers + layer];
+					if (!dst.empty())
+						continue;
+
+					int& id = task[p][o*layers + layer];
+					// chroma is converted from the BGR base when it is wanted anyway
+					if (o == 0 && layer == 0 && p == HSV && (wanted[BGR] || !pyr[BGR][0].empty()))
+					{
+						const Mat* bgr = &pyr[BGR][0];
+						Mat* chroma = &dst;
+						id = builder.add([=, &builder]() { chroma->create(bgr->size(), CV_MAKETYPE(pyrDepth, 2)); return builder.bands(bgr->rows); },
+							[=](int b, int n) {
+							Range rows(bgr->rows*b / n, bgr->rows*(b + 1) / n);
+							Mat band = chroma->rowRange(rows);
+							convertToChroma(bgr->rowRange(rows), band);
+						});
+						builder.depend(task[BGR][0], id);
+					}
+					// and otherwise from the color image as it is blurred, which is freed once done
+					else if (o == 0 && layer == 0 && p == HSV)
+					{
+						Ptr<Mat> color = makePtr<Mat>();
+						Mat* chroma = &dst;
+						double s = baseSigmaDiff(firstOctv < 0, (float)sig0);
+						int colorId = builder.add([=]() { *color = createUnblurredColorImage(img, firstOctv < 0, pyrDepth); });
+						id = builder.add([=, &builder]() { chroma->create(color->size(), CV_MAKETYPE(pyrDepth, 2)); return builder.bands(color->rows); },
+							[=](int b, int n) {
+							blurRowsToChroma(*color, *chroma, s, color->rows*b / n, color->rows*(b + 1) / n);
+						});
+						builder.depend(colorId, id);
+						int freeId = builder.add([=]() { color->release(); });
+						builder.depend(id, freeId);
+					}
+					else if (o == 0 && layer == 0)
+					{
+						Pyramid q = (Pyramid)p;
+						Mat* base = &dst;
+						id = builder.add([=]() { *base = createBase(q); });
+					}
+					// base of new octave is halved image from end of previous octave
+					else if (layer == 0)
+					{
+						const Mat* src = &pyr[p][(o - 1)*layers + nLayers];
+						Mat* half = &dst;
+						id = builder.add([=]() { resize(*src, *half, Size(src->cols / 2, src->rows / 2), 0, 0, INTER_NEAREST); });
+						builder.depend(task[p][(o - 1)*layers + nLayers], id);
+					}
+					// every band reads the rows around it from the whole level, so the bands
+					// together give the same level as one blur of the whole image
+					else
+					{
+						const Mat* src = &pyr[p][o*layers + layer - 1];
+						Mat* blurred = &dst;
+						double s = sig[layer];
+						id = builder.add([=, &builder]() { blurred->create(src->size(), src->type()); return builder.bands(src->rows); },
+							[=](int b, int n) {
+							Range rows(src->rows*b / n, src->rows*(b + 1) / n);
+							Mat band = blurred->rowRange(rows);
+							blurRows(*src, band, s, rows.start, rows.end);
+						});
+						builder.depend(task[p][o*layers + layer - 1], id);
+					}
+				}
+			}
+		}
+
+		// DoG levels built by this call
+		vector<Mat*> diffs;
+		if (dog && !allBuilt(dogpyr, (size_t)(nOctaves*(nLayers + 2))))
+		{
+			dogpyr.resize(nOctaves*(nLayers + 2));
+			for (int o = 0; o < nOctaves; o++)
+			{
+				for (int i = 0; i < nLayers + 2; i++)
+				{
+					const Mat* src1 = &pyr[GRAY][o*layers + i];
+					const Mat* src2 = &pyr[GRAY][o*layers + i + 1];
+					Mat* diff = &dogpyr[o*(nLayers + 2) + i];
+					if (!diff->empty())
+						continue;
+					diffs.push_back(diff);
+					int id = builder.add([=, &builder]() { diff->create(src1->size(), pyrDepth); return builder.bands(src1->rows); },
+						[=](int b, int n) {
+						Range rows(src1->rows*b / n, src1->rows*(b + 1) / n);
+						Mat band = diff->rowRange(rows);
+						subtract(src2->rowRange(rows), src1->rowRange(rows), band, noArray(), pyrDepth);
+					});
+					// layer i + 1 is built after layer i
+					builder.depend(task[GRAY][o*layers + i + 1], id);
+				}
+			}
+		}
+
+		// a failed task may leave its level allocated but partly written, and the levels after it
+		// unbuilt. Release every level this call was to build, so that the next request builds
+		// them again instead of taking them as done
+		try
+		{
+			builder.run();
+		}
+		catch (...)
+		{
+			for (int p = 0; p < NUM_PYRAMIDS; p++)
+			{
+				for (size_t i = 0; i < task[p].size(); i++)
+				{
+					if (task[p][i] >= 0)
+						pyr[p][i].release();
+				}
+			}
+			for (size_t i = 0; i < diffs.size(); i++)
+				diffs[i]->release();
+			throw;
+		}
+	}
+}
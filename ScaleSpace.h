@@ -0,0 +1,159 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+/*
+ScaleSpace.h
+
+Per-image cache of the Gaussian scale-space pyramids that keypoint detection and the
+descriptor extractors work on: the grey pyramid, its DoG pyramid, the BGR float pyramid,
+the HSV pyramid and the opponent color pyramid. The HSV pyramid holds hue H and saturation
+S as the two channels of the chroma vector (S cos H, S sin H), which unlike hue can be
+blurred linearly across the 0/360 degree wrap; no descriptor reads the value. Its base is
+converted from the blurred BGR base in the same pass that blurs it, unless the BGR pyramid
+is built anyway. Every level is built lazily on first request, so an image that is run
+through several descriptor types blurs each pyramid exactly once, and a descriptor-only
+run never builds the levels its keypoints do not refer to.
+
+The levels are float by default. A fixed-point scale space stores them as 16-bit integers
+scaled as PyramidScale<short> describes (SIFTCore.h), which halves the memory of every
+pyramid at the cost of quantizing the blurred values to 1/48 of an intensity step.
+
+A ScaleSpace is not thread safe while levels are being built. Call prepare() (or one of
+the whole-pyramid accessors) first; after that the built levels may be read concurrently.
+
+build() constructs several pyramids up front as one task graph on a pool of threads. The
+layers of one octave depend on each other, but the grey, color, HSV and opponent pyramids
+and the DoG differences do not, so they run side by side; every blur, difference and color
+conversion is further split into bands of rows.
+*/
+
+#ifndef SCALE_SPACE_H
+#define SCALE_SPACE_H
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+using namespace std;
+
+namespace cv
+{
+	class ScaleSpace
+	{
+	public:
+		// the pyramids a scale space can hold; HSV levels hold the chroma vector (S cos H, S sin H)
+		// and OPPONENT levels the opponent colors (O1, O2, O3)
+		enum Pyramid { GRAY, BGR, HSV, OPPONENT, NUM_PYRAMIDS };
+
+		// Wraps a CV_8U image. firstOctave is -1 to double the image before the pyramids are
+		// built (as for detection) or 0 to start at the original size. depth is the element
+		// depth of every pyramid: CV_32F, or CV_16S for fixed point. nOctaves fixes the number
+		// of octaves; 0 derives it from the image size
+		ScaleSpace(const Mat& image, int firstOctave = -1, int nOctaveLayers = 3, double sigma = 1.6,
+			int depth = CV_32F, int nOctaves = 0);
+
+		// Number of octaves the pyramids of an image of the given size have by default
+		static int octaveCount(Size imageSize, int firstOctave);
+
+		// Margin, in image pixels, around a tile of an image whose keypoints of the first nOctaves
+		// octaves are detected and described on the tile alone. Every pixel the pyramid levels,
+		// the extremum search and a descrWidth x descrWidth descriptor of such a keypoint read
+		// lies within it, so the tile gives the same keypoints and descriptors as the whole image
+		static int tileMargin(int firstOctave, int nOctaves, int nOctaveLayers, double sigma, int descrWidth);
+
+		// Step that tile origins must be multiples of, so that the downsampled octaves of a tile
+		// sample the same pixels as those of the whole image
+		static int tileAlignment(int firstOctave, int nOctaves);
+
+		const Mat& image() const { return img; }
+		int firstOctave() const { return firstOctv; }
+		int nOctaveLayers() const { return nLayers; }
+		double sigma() const { return sig0; }
+		int depth() const { return pyrDepth; }
+
+		// number of octaves held by every pyramid
+		int octaves() const { return nOctaves; }
+
+		// Returns level (octave, layer) of a pyramid, building it and the levels it is derived
+		// from first. octave counts from 0, which corresponds to firstOctave()
+		const Mat& level(Pyramid p, int octave, int layer);
+
+		// Returns a whole Gaussian pyramid, laid out as octave*(nOctaveLayers + 3) + layer
+		const vector<Mat>& gaussianPyramid(Pyramid p);
+
+		// Returns the DoG pyramid of the grey image, laid out as octave*(nOctaveLayers + 2) + layer
+		const vector<Mat>& dogPyramid();
+
+		// Builds only the levels of a pyramid that the given keypoints are described from
+		void prepare(Pyramid p, const vector<KeyPoint>& keypoints);
+
+		// Builds the given pyramids and, with dog, the grey and DoG pyramids, using nThreads
+		// threads (0 lets OpenCV decide). The grey pyramid is built in full, the others up to
+		// layer nOctaveLayers, the highest a detected keypoint is described from
+		void build(const vector<Pyramid>& pyramids, bool dog, int nThreads = 0);
+
+		// Returns a pyramid as built so far. Levels that have not been built are empty
+		const vector<Mat>& pyramid(Pyramid p) const { return pyr[p]; }
+
+		// Dense per-pixel maps that the descriptor code derives from the levels of a pyramid and
+		// keeps with them, laid out like the pyramid. Levels without a map have an empty Mat
+		vector<Mat>& denseMaps(Pyramid p) { return maps[p]; }
+
+		// Bytes held by all levels built so far, the DoG pyramid and the dense maps included
+		size_t memoryBytes() const;
+
+	private:
+		void ensureOctaves(int n);
+		Mat createBase(Pyramid p);
+
+		Mat img;
+		int firstOctv;
+		int nLayers;
+		double sig0;
+		int pyrDepth;
+		int nOctaves;
+		vector<double> sig;
+		vector<Mat> pyr[NUM_PYRAMIDS];
+		vector<Mat> maps[NUM_PYRAMIDS];
+		vector<Mat> dogpyr;
+	};
+}
+
+#endif
@@ -4,33 +4,92 @@
 #include "DescriptorUtil.h"
 #include "DescriptorType.h"
 #include "ScriptData.h"
+#include "BatchDriver.h"
+#include "DescriptorStore.h"
+#include "Benchmark.h"
 
 #include <iostream>
 
 using namespace cv;
 using namespace std;
 
+// Most images (with their scale spaces) held in memory while keypoints and descriptors are computed
+static const int maxInFlight = 4;
+
 
 int main(int argc, char *argv[]) {
 	DescriptorUtil descriptorUtil;
+	// Exact matching, so that the evaluation is the same on every run
+	descriptorUtil.setMatcher(BRUTE_FORCE_MATCHER);
+	// Rank matches by Lowe's ratio test, keeping only mutual nearest neighbours, instead of by distance
+	// descriptorUtil.setRatioTest(true, true);
+	// Compute the gradients and hues of densely sampled pyramid levels once per level instead of once per keypoint
+	// descriptorUtil.setDenseMaps(true);
+
+	// Options come before the script arguments:
+	//   --bench-matchers  time FLANN against the brute-force matcher instead of evaluating the matches
+	//   --fixed-point     keep the pyramids as 16-bit fixed point, writing the results to desc_*_16s.txt
+	//                     so that they can be compared with those of a float run
+	//   --bench-newsift   time NEWSIFT's descriptors for growing keypoint subsets of the first image, then exit
+	//   --bench-pyramids  time the pyramids of the first image, scaled to 2 MP, on 1, 2 and 4 threads, then exit;
+	//                     with --fixed-point, the pyramids are 16-bit
+	bool benchMatchers = false;
+	bool benchNewSift = false;
+	bool benchPyramids = false;
+	bool fixedPoint = false;
+	string resultSuffix;
+	int numOptions = 0;
+	while (numOptions + 1 < argc && string(argv[numOptions + 1]).compare(0, 2, "--") == 0) {
+		string option = argv[++numOptions];
+		if (option == "--bench-matchers") {
+			benchMatchers = true;
+		}
+		else if (option == "--bench-newsift") {
+			benchNewSift = true;
+		}
+		else if (option == "--bench-pyramids") {
+			benchPyramids = true;
+		}
+		else if (option == "--fixed-point") {
+			fixedPoint = true;
+			descriptorUtil.setFixedPointPyramids(true);
+			resultSuffix = "_16s";
+		}
+		else {
+			cout << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	// ScriptData reads its arguments from args[1] on
+	char **args = argv + numOptions;
+	argc -= numOptions;
 
 	if (argc == 1) {
-		argv = new char*[8];
-		argv[0] = "../Debug/ColorHist.exe";
-		argv[1] = "../images/bark/";
-		argv[2] = "2";
-		argv[3] = "img1.ppm";
-		argv[4] = "img2.ppm";
-		argv[5] = "1";
-		argv[6] = "HSSIFT";
-		argv[7] = "H1to2p.txt";
+		args = new char*[8];
+		args[0] = "../Debug/ColorHist.exe";
+		args[1] = "../images/bark/";
+		args[2] = "2";
+		args[3] = "img1.ppm";
+		args[4] = "img2.ppm";
+		args[5] = "1";
+		args[6] = "HSSIFT";
+		args[7] = "H1to2p.txt";
 	}
 
-	string scriptFilename = argv[1];
-	ScriptData data(argv);
+	string scriptFilename = args[1];
+	ScriptData data(args);
 
 	// If the script succeeded in loading
-	if (!data.failed) {
+	if (!data.failed && (benchNewSift || benchPyramids)) {
+		Mat image = imread(data.relativePath + data.imageNames[0]);
+		if (benchNewSift) {
+			benchmarkNewSift(image);
+		}
+		if (benchPyramids) {
+			benchmarkPyramids(image, fixedPoint ? CV_16S : CV_32F);
+		}
+	}
+	else if (!data.failed) {
 		// Initialize storage
 		Mat *images = new Mat[data.numImgs];
 		vector<KeyPoint> *kpts = new vector<KeyPoint>[data.numImgs];
@@ -39,64 +98,47 @@ int main(int argc, char *argv[]) {
 			descriptors[i] = new Mat[data.numImgs];
 		}
 
-		// Load images and compute keypoints for each image
-		for (int i = 0; i < data.numImgs; ++i) {
-			images[i] = imread((data.relativePath + data.imageNames[i]).c_str());
-			//cv::cvarrToMat(cvLoadImage((data.relativePath + data.imageNames[i]).c_str()));
-			cout << ">> Computing keypoints for " << data.imageNames[i] << "..." << endl;
-
-			// Load from file or detect new features
-			descriptorUtil.detectFeatures(images[i], kpts[i]);
-			// kpts[i] = descriptorUtil.readKeyPoints(data.relativePath + "kpts.xml", data.imageNames[i].substr(0, data.imageNames[i].length() - 4 ));
-		}
-		cout << ">> Finished computing all keypoints" << endl;
-
-		// Save keypoints if save flag is set
-		if (data.saveData) {
-			cout << ">> Saving keypoints to: kpts.xml" << endl;
-			descriptorUtil.writeKeyPoints(kpts, data.imageNames, data.numImgs, data.relativePath + "kpts.xml");
-		}
-
-		// Compute descriptors
-		for (int i = 0; i < data.numTypes; ++i) {
-			// Inner array of descriptor matrices contains only one type of descriptor
-			cout << ">> Computing descriptor type #" << i << "..." << endl;
-
-			// Compute descriptors for each image
-			for (int j = 0; j < data.numImgs; ++j) {
-				if (data.types[i].doubleDescriptor) {
-					Mat &descriptors1 = descriptorUtil.computeDescriptors(images[j], kpts[j], data.types[i].first);
-					Mat &descriptors2 = descriptorUtil.computeDescriptors(images[j], kpts[j], data.types[i].second);
-
-					// Merge descriptors
-					descriptors[i][j] = descriptorUtil.mergeDescriptors(descriptors1, descriptors2);
-				}
-				else {
-					descriptors[i][j] = descriptorUtil.computeDescriptors(images[j], kpts[j], data.types[i].first);
-				}
+		// Load images, compute keypoints and then every descriptor type, several images at a time. Each
+		// image's descriptor types share its scale space, which is freed as soon as the image is done.
+		// Whole images run in parallel, so every image is described on a single thread
+		int numWorkers = std::max(1, std::min(getNumberOfCPUs(), maxInFlight));
+		descriptorUtil.setNumThreads(numWorkers > 1 ? 1 : 0);
+		BatchDriver driver(descriptorUtil, numWorkers, maxInFlight);
+		driver.run(data.relativePath, data.imageNames, data.numImgs, data.types, data.numTypes, [&](BatchImage &result) {
+			// Every image fills its own slots, so results can be stored without locking
+			int j = result.index;
+			images[j] = result.image;
+			kpts[j].swap(result.kpts);
+			for (int i = 0; i < data.numTypes; ++i) {
+				descriptors[i][j] = result.descriptors[i];
 			}
-		}
+		});
+		cout << ">> Finished computing all keypoints and descriptors" << endl;
 
-		// Save descriptors if save flag is set
+		// Save keypoints and descriptors if save flag is set. Every descriptor type goes to its own binary
+		// store, which holds the keypoints too; DescriptorStore::toXml converts a store to the old XML files
 		// data.saveData = true;
 
 		if (data.saveData) {
 			for (int i = 0; i < data.numTypes; ++i) {
-				cout << ">> Saving descriptors for type #" << i << endl;
-
-				stringstream descriptorFilePath;
-				descriptorFilePath << data.relativePath << "descriptors" << i << ".xml";
-				descriptorUtil.writeDescriptors(descriptors[i], data.imageNames, data.numImgs, descriptorFilePath.str());
+				stringstream storePath;
+				storePath << data.relativePath << "descriptors" << i << ".bin";
+				cout << ">> Saving keypoints and descriptors for type #" << i << " to: " << storePath.str() << endl;
+				DescriptorStore::write(storePath.str(), data.imageNames, kpts, descriptors[i], data.numImgs);
 			}
 		}
 
 		bool drawMatches = true;
-		// Matching using homographies, if provided
-		if (data.homographyFlag) {
+		if (benchMatchers) {
+			benchmarkMatchers(descriptors, data.numTypes, data.numImgs);
+		}
+		// Matching using homographies, if provided. Image 0 queries each other image, whose descriptors are
+		// indexed once per pair; the brute-force matcher's index only holds the descriptors, so that is cheap
+		else if (data.homographyFlag) {
 			for (int i = 0; i < data.numImgs - 1; ++i) {
 				for (int j = 0; j < data.numTypes; ++j) {
 					stringstream outFilename;
-					outFilename << data.relativePath << "desc_" << j << "_img_" << (i + 1) << ".txt";
+					outFilename << data.relativePath << "desc_" << j << "_img_" << (i + 1) << resultSuffix << ".txt";
 					descriptorUtil.match(descriptors[j][0], descriptors[j][i + 1], kpts[0], kpts[i + 1], images[0], images[i + 1], data.homographies[i], outFilename.str(), drawMatches);
 				}
 			}
@@ -110,7 +152,7 @@ int main(int argc, char *argv[]) {
 		}
 		delete[] descriptors;
 		if (argc == 1) {
-			delete argv;
+			delete[] args;
 		}
 	}
 